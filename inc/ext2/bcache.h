@@ -0,0 +1,49 @@
+#pragma once
+
+typedef struct Buf Buf;
+
+struct Buf {
+    uint32_t block;
+    int valid; // hashed under block
+    int dirty;
+    uint64_t dirtied; // ms timestamp of the clean to dirty transition
+    Buf *hnext; // hash chain
+    Buf *prev;  // lru list
+    Buf *next;
+    char *data;
+    IoReq *io;   // readahead still in flight
+    void *batch; // submission io belongs to
+};
+
+typedef struct {
+    Vnode *bdev;
+    uint32_t blocksz;
+    int maxbufs;
+    int numbufs;
+    int numbuckets;
+    Buf **buckets;
+    Buf lru; // list head, most recently used first
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;
+    int numdirty;
+    pthread_mutex_t lock; // held by every bcache call and the flusher
+    pthread_cond_t kick;  // wakes the flusher early
+    pthread_t flusher;
+    int hasflusher;
+    int stopflusher;
+    uint64_t flushbytes;
+    int flushage;
+    uint64_t flushes;
+} BCache;
+
+int bcacheinit(BCache *bc, Vnode *bdev, uint32_t blocksz, int maxbufs);
+int bcacheread(BCache *bc, uint32_t block, void *dst);
+int bcachewrite(BCache *bc, uint32_t block, void *src);
+int bcachedirty(BCache *bc, uint32_t block);
+int bcachecached(BCache *bc, uint32_t block);
+int bcachereadahead(BCache *bc, uint32_t *blocks, int n);
+int bcacheprefetch(BCache *bc, uint32_t *blocks, int n);
+int bcacheflush(BCache *bc);
+int bcachestartflusher(BCache *bc, uint64_t flushbytes, int flushage);
+void bcachefree(BCache *bc);
@@ -0,0 +1,27 @@
+#pragma once
+
+#define DCACHE_ENTRIES 1024
+
+typedef struct Dentry Dentry;
+
+// one cached name; positive entries hold a reference on vn
+struct Dentry {
+    void *device;
+    Vnum parent;
+    char name[MAX_NAME];
+    int negative;
+    Vnode vn;
+    char *target; // symlink target once read, 0 before
+    Dentry *hnext; // hash chain
+    Dentry *prev;  // lru list
+    Dentry *next;
+};
+
+// looks name up in parent through the cache, dst holds its own reference
+int dcachefind(Vnode *parent, Vnode *dst, char *name);
+// reads the target of the link found under name in parent into dst
+int dcachelink(Vnode *parent, char *name, Vnode *link, char *dst, int size);
+// drops the entry of name in parent, positive or negative
+void dcacheforget(Vnode *parent, char *name);
+// drops every entry of a device, releasing the vnodes it holds
+void dcachepurge(void *device);
@@ -0,0 +1,12 @@
+#pragma once
+
+#define DX_HASH_LEGACY            0
+#define DX_HASH_HALF_MD4          1
+#define DX_HASH_TEA               2
+#define DX_HASH_LEGACY_UNSIGNED   3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED      5
+
+// hashes a directory entry name the way the htree index orders it, seed
+// being the superblock's hashseed; the low bit of the result is always 0
+uint32_t dxhash(char *name, int len, int version, uint32_t *seed);
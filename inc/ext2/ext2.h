@@ -31,8 +31,8 @@ typedef struct {
     uint16_t inodesz;
     uint16_t blockgroup;
     uint32_t featuresopt;
-    uint16_t featuresreq;
-    uint16_t featuresro;
+    uint32_t featuresreq;
+    uint32_t featuresro;
     char uuid[16];
     char name[16];
     char lastmount[64];
@@ -44,6 +44,21 @@ typedef struct {
     uint32_t jrnlinode;
     uint32_t jrnldev;
     uint32_t orphan;
+    // ext3/ext4 fields
+    uint32_t hashseed[4];
+    uint8_t defhashversion;
+    uint8_t jrnlbackuptype;
+    uint16_t descsz;
+    uint32_t defmountopts;
+    uint32_t firstmetabg;
+    uint32_t mkfstime;
+    uint32_t jrnlblocks[17];
+    uint32_t numblockshi;
+    uint32_t numreservedblockshi;
+    uint32_t numfreeblockshi;
+    uint16_t minextraisize;
+    uint16_t wantextraisize;
+    uint32_t flags;
 } Superblock;
 
 typedef struct {
@@ -57,13 +72,79 @@ typedef struct {
     char _reserved[12];
 } Group;
 
+#define EXT2_CACHE_BLOCKS 1024
+#define EXT2_CACHE_INODES 256
+
+#define EXT2_MAP_RUNS 4
+
+// contiguous stretch of file blocks
+typedef struct {
+    uint32_t lblock;
+    uint32_t pblock;
+    uint32_t len;
+} Run;
+
+typedef struct Ient Ient;
+
+// in-core inode
+struct Ient {
+    uint32_t inum;
+    int refs; // held by vnodes, pins the entry
+    int dirty;
+    Ient *hnext; // hash chain
+    Ient *prev;  // lru list
+    Ient *next;
+    uint8_t *raw; // on-disk inode, inodesz bytes
+    Run runs[EXT2_MAP_RUNS]; // recently resolved block mappings
+    int nextrun;
+    uint32_t rafirst; // first block of the last read
+    int rastride; // blocks between the last two reads
+    int rawindow; // blocks to read ahead, 0 until a stride repeats
+    uint32_t palogical; // file block the preallocation window continues at
+    uint32_t paphys; // first reserved device block
+    uint32_t palen; // reserved blocks left, allocated to no file yet
+    uint32_t pasize; // size of the next window, doubles while writes stream
+    uint32_t pastop; // file block the write in progress ends before
+};
+
+// a group's allocation bitmap, resident from its first use on
+typedef struct {
+    uint64_t *words; // 0 until loaded
+    uint32_t hint; // no bit below it is free
+    uint32_t maxrun; // no free run is longer, UINT32_MAX if unknown
+    int dirty; // changed since it was last written to the cache
+} Bitmap;
+
+// mount flags, atime updates default to relatime
+#define EXT2_NOATIME     0x1 // never update atime
+#define EXT2_STRICTATIME 0x2 // update atime on every read
+#define EXT2_RDONLY      0x4 // refuse changes, implies noatime
+
+typedef struct {
+    int flags; // mount flags
+    int cacheblocks; // block cache size, 0 for default
+    uint64_t flushbytes; // flusher dirty limit, 0 for none
+    int flushage; // flusher age limit in ms, 0 for none
+} Ext2Opts;
+
 typedef struct {
     Vnode *bdev;
+    BCache bcache;
+    int flags; // mount flags
     Superblock sb;
+    int sbdirty; // free counts changed since the last sync
     uint32_t inodesz;
     uint32_t blocksz;
     uint32_t numgroups;
     uint32_t ppb; // pointers per block
+    uint32_t descsz; // group descriptor size
+    char *groups; // resident descriptor table
+    uint8_t *groupsdirty; // per descriptor table block
+    Bitmap *blockmaps; // per group
+    Bitmap *inodemaps;
+    Ient *ibuckets[EXT2_CACHE_INODES];
+    Ient ilru; // most recently used first
+    int numients;
 } Ext2;
 
 typedef struct {
@@ -87,6 +168,28 @@ typedef struct {
     char osval2[12];
 } Inode;
 
+typedef struct {
+    uint16_t magic;
+    uint16_t entries;
+    uint16_t max;
+    uint16_t depth;
+    uint32_t generation;
+} ExtHeader;
+
+typedef struct {
+    uint32_t block;
+    uint32_t leaflo;
+    uint16_t leafhi;
+    uint16_t _unused;
+} ExtIdx;
+
+typedef struct {
+    uint32_t block;
+    uint16_t len;
+    uint16_t starthi;
+    uint32_t startlo;
+} Extent;
+
 typedef uint32_t Inum;
 
 typedef struct {
@@ -97,4 +200,37 @@ typedef struct {
     char name[];
 } Ext2DirEnt;
 
-int mkext2(Vnode *dst, Vnode *bdev);
+// extended attribute in the inode body, values are addressed from the
+// first entry
+typedef struct {
+    uint8_t namelen;
+    uint8_t nameindex;
+    uint16_t valueoff;
+    uint32_t valueinum;
+    uint32_t valuesize;
+    uint32_t hash;
+    char name[];
+} XattrEntry;
+
+// htree root, follows the . and .. entries of an indexed directory
+typedef struct {
+    uint32_t reserved;
+    uint8_t hashversion;
+    uint8_t infolen;
+    uint8_t levels; // index levels below the root
+    uint8_t flags;
+} DxRootInfo;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t block; // directory block number
+} DxEntry;
+
+// overlays the hash of the first entry of every index node
+typedef struct {
+    uint16_t limit;
+    uint16_t count;
+    uint32_t block;
+} DxCountLimit;
+
+int mkext2(Vnode *dst, Vnode *bdev, Ext2Opts *opts);
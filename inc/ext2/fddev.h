@@ -0,0 +1,9 @@
+#pragma once
+
+#define FDDEV_DIRECT      0x1 // bypass the page cache with O_DIRECT
+#define FDDEV_FSYNC_NONE  0x2 // never fsync, leave it to the kernel
+#define FDDEV_FSYNC_WRITE 0x4 // fsync after every write
+#define FDDEV_RDONLY      0x8 // open the image read-only
+
+// fsyncs on vfssync unless one of the fsync flags says otherwise
+int mkfddev(Vnode *dst, char *filename, int flags);
@@ -1,3 +1,5 @@
 #pragma once
 
-int mkfdev(Vnode *dst, char *filename);
+#define FDEV_RDONLY 0x1 // open the image read-only
+
+int mkfdev(Vnode *dst, char *filename, int flags);
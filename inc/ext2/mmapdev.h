@@ -0,0 +1,5 @@
+#pragma once
+
+#define MMAPDEV_RDONLY 0x1 // map the image read-only
+
+int mkmmapdev(Vnode *dst, char *filename, int flags);
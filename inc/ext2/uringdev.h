@@ -0,0 +1,8 @@
+#pragma once
+
+#define URINGDEV_DEPTH 64
+
+#define URINGDEV_RDONLY 0x1 // open the image read-only
+
+// depth is the submission queue size, 0 for the default
+int mkuringdev(Vnode *dst, char *filename, int depth, int flags);
@@ -9,32 +9,67 @@
 
 #define VFS_MASK_FMT 0xf000
 
+#define VFS_IO_READ  0
+#define VFS_IO_WRITE 1
+
 typedef int64_t Vnum;
 typedef struct Vnode Vnode;
 typedef struct Stat Stat;
+typedef struct DirEntPlus DirEntPlus;
 
 typedef struct {
     Vnum vnum;
+    int type; // format bits of the entry's mode, 0 if the fs doesn't say
     char name[MAX_NAME];
 } DirEnt;
 
+// one request of a batch, res and done are set on completion
+typedef struct {
+    int op;
+    void *buf;
+    int64_t off;
+    int count;
+    int res;
+    int done;
+} IoReq;
+
+typedef struct {
+    void *base;
+    int len;
+} IoVec;
+
 struct Vnode {
     char name[MAX_NAME];
     void *device;
     Vnum vnum;
     int flags;
-    int (*read)(Vnode *vn, void *dst, int off, int count);
-    int (*write)(Vnode *vn, int off, int count, void *src);
+    int (*read)(Vnode *vn, void *dst, int64_t off, int count);
+    int (*readv)(Vnode *vn, IoVec *iov, int n, int64_t off);
+    int (*write)(Vnode *vn, int64_t off, int count, void *src);
     int (*find)(Vnode *parent, Vnode *dst, char *name);
-    int (*readdir)(Vnode *parent, DirEnt *dst, int index);
+    int (*readdir)(Vnode *parent, int64_t *off, DirEnt *dst, int n);
+    int (*readdirplus)(Vnode *parent, int64_t *off, DirEntPlus *dst, int n);
     int (*create)(Vnode *parent, char *name, int isdir);
     int (*truncate)(Vnode *vn);
+    int (*compact)(Vnode *dir);
     int (*unlink)(Vnode *parent, char *name);
     int (*symlink)(Vnode *parent, char *name, char *value);
     int (*link)(Vnode *old, Vnode *newdir, char *newname);
     int (*stat)(Vnode *vn, Stat *dst);
+    int (*sync)(Vnode *vn);
+    int (*retain)(Vnode *vn);
+    int (*release)(Vnode *vn);
+    void *(*map)(Vnode *vn, int64_t off, int count);
+    int (*submit)(Vnode *vn, IoReq *reqs, int n);
+    int (*complete)(Vnode *vn, int min);
 };
 
+// open directory, off is the filesystem's position in it
+typedef struct {
+    Vnode dir;
+    int64_t off;
+} Dir;
+
 struct Stat {
     uint32_t dev;
     uint32_t inum;
@@ -51,15 +86,34 @@ struct Stat {
     uint32_t ctime;
 };
 
-int vfsread(Vnode *vn, void *dst, int off, int count);
-int vfswrite(Vnode *vn, int off, int count, void *src);
+// a directory entry along with the attributes of what it names
+struct DirEntPlus {
+    DirEnt ent;
+    Stat stat;
+};
+
+int vfsread(Vnode *vn, void *dst, int64_t off, int count);
+int vfsreadv(Vnode *vn, IoVec *iov, int n, int64_t off);
+int vfswrite(Vnode *vn, int64_t off, int count, void *src);
 int vfsfind(Vnode *parent, Vnode *dst, char *name);
 int vfsresolve(Vnode *root, Vnode *parent, Vnode *dst, char *path);
-int vfsreaddir(Vnode *parent, DirEnt *dst, int index);
+int vfsopendir(Vnode *vn, Dir *dst);
+int vfsreaddir(Dir *dir, DirEnt *dst);
+int vfsreaddirv(Dir *dir, DirEnt *dst, int n);
+int vfsreaddirplus(Dir *dir, DirEntPlus *dst, int n);
+int vfsclosedir(Dir *dir);
 int vfscreate(Vnode *parent, char *path, int isdir);
 int vfstruncate(Vnode *vn);
+int vfscompact(Vnode *dir);
 int vfsunlink(Vnode *parent, char *path);
 int vfsmkdir(Vnode *parent, char *path);
 int vfssymlink(Vnode *parent, char *path, char *value);
 int vfslink(Vnode *old, Vnode *newdir, char *newname);
 int vfsstat(Vnode *vn, Stat *dst);
+int vfssync(Vnode *vn);
+int vfsretain(Vnode *vn);
+int vfsrelease(Vnode *vn);
+void *vfsmap(Vnode *vn, int64_t off, int count);
+int vfssubmit(Vnode *vn, IoReq *reqs, int n);
+int vfscomplete(Vnode *vn, int min);
+int vfsbatch(Vnode *vn, IoReq *reqs, int n);
@@ -0,0 +1,394 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <ext2/vfs.h>
+#include <ext2/bcache.h>
+
+#define BUF_ALIGN 4096
+#define FLUSH_BATCH 32
+#define FLUSH_IDLE_MS 1000
+
+// one readahead submission; freed once every buffer in it has settled
+typedef struct {
+    int left;
+    IoReq reqs[];
+} Batch;
+
+static uint64_t nowms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static Buf **bucket(BCache *bc, uint32_t block) {
+    return &bc->buckets[block & (bc->numbuckets - 1)];
+}
+
+static Buf *lookup(BCache *bc, uint32_t block) {
+    for (Buf *b = *bucket(bc, block); b; b = b->hnext)
+        if (b->block == block)
+            return b;
+    return 0;
+}
+
+static void unhash(BCache *bc, Buf *b) {
+    if (!b->valid) return;
+    b->valid = 0;
+    Buf **pp = bucket(bc, b->block);
+    while (*pp != b)
+        pp = &(*pp)->hnext;
+    *pp = b->hnext;
+}
+
+static void rehash(BCache *bc, Buf *b, uint32_t block) {
+    b->block = block;
+    b->valid = 1;
+    Buf **pp = bucket(bc, block);
+    b->hnext = *pp;
+    *pp = b;
+}
+
+static void unlist(Buf *b) {
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+}
+
+static void pushfront(BCache *bc, Buf *b) {
+    b->prev = &bc->lru;
+    b->next = bc->lru.next;
+    bc->lru.next->prev = b;
+    bc->lru.next = b;
+}
+
+static void pushback(BCache *bc, Buf *b) {
+    b->next = &bc->lru;
+    b->prev = bc->lru.prev;
+    bc->lru.prev->next = b;
+    bc->lru.prev = b;
+}
+
+static void touch(BCache *bc, Buf *b) {
+    unlist(b);
+    pushfront(bc, b);
+}
+
+// waits for a buffer's readahead to finish, unhashing it if the read failed
+static void settle(BCache *bc, Buf *b) {
+    if (!b->io) return;
+    while (!b->io->done)
+        if (vfscomplete(bc->bdev, 1) < 0) {
+            b->io->res = -1;
+            break;
+        }
+    int n = b->io->res;
+    Batch *batch = b->batch;
+    b->io = 0;
+    b->batch = 0;
+    if (--batch->left == 0)
+        free(batch);
+    if (n < 0) {
+        unhash(bc, b);
+        unlist(b);
+        pushback(bc, b);
+        return;
+    }
+    memset(b->data + n, 0, bc->blocksz - n);
+}
+
+static int writeback(BCache *bc, Buf *b) {
+    int n = vfswrite(bc->bdev, (uint64_t)b->block * bc->blocksz, bc->blocksz, b->data);
+    if (n != bc->blocksz) {
+        printf("*** couldn't write back block %u\n", b->block);
+        return -1;
+    }
+    b->dirty = 0;
+    bc->numdirty--;
+    bc->writebacks++;
+    return 0;
+}
+
+static void markdirty(BCache *bc, Buf *b) {
+    if (b->dirty) return;
+    b->dirty = 1;
+    b->dirtied = nowms();
+    bc->numdirty++;
+    if (bc->flushbytes && (uint64_t)bc->numdirty * bc->blocksz >= bc->flushbytes)
+        pthread_cond_signal(&bc->kick);
+}
+
+// returns an unhashed buffer, either fresh or evicted from the lru tail
+static Buf *getfree(BCache *bc) {
+    if (bc->numbufs < bc->maxbufs) {
+        Buf *b = malloc(sizeof(Buf));
+        if (!b) return 0;
+        memset(b, 0, sizeof(Buf));
+        // page aligned so direct i/o devices can use it without bouncing
+        if (posix_memalign((void **)&b->data, BUF_ALIGN, bc->blocksz)) {
+            free(b);
+            return 0;
+        }
+        bc->numbufs++;
+        pushfront(bc, b);
+        return b;
+    }
+    Buf *b = bc->lru.prev;
+    settle(bc, b);
+    if (b->dirty && writeback(bc, b))
+        return 0;
+    unhash(bc, b);
+    return b;
+}
+
+// finds or allocates the buffer for block, reading it in only if fill is set
+static Buf *getbuf(BCache *bc, uint32_t block, int fill) {
+    Buf *b = lookup(bc, block);
+    if (b) settle(bc, b);
+    if (b && b->valid) {
+        bc->hits++;
+        touch(bc, b);
+        return b;
+    }
+    bc->misses++;
+    b = getfree(bc);
+    if (!b) return 0;
+    if (fill) {
+        int n = vfsread(bc->bdev, b->data, (uint64_t)block * bc->blocksz, bc->blocksz);
+        if (n < 0) {
+            // park the unhashed buffer at the tail so it's reused first
+            unlist(b);
+            pushback(bc, b);
+            return 0;
+        }
+        memset(b->data + n, 0, bc->blocksz - n);
+    }
+    b->dirty = 0;
+    rehash(bc, b, block);
+    touch(bc, b);
+    return b;
+}
+
+int bcacheinit(BCache *bc, Vnode *bdev, uint32_t blocksz, int maxbufs) {
+    memset(bc, 0, sizeof(BCache));
+    bc->bdev = bdev;
+    bc->blocksz = blocksz;
+    bc->maxbufs = maxbufs > 0 ? maxbufs : 1;
+    bc->numbuckets = 1;
+    while (bc->numbuckets < bc->maxbufs)
+        bc->numbuckets <<= 1;
+    bc->buckets = calloc(bc->numbuckets, sizeof(Buf *));
+    if (!bc->buckets) return -1;
+    bc->lru.prev = &bc->lru;
+    bc->lru.next = &bc->lru;
+    pthread_mutex_init(&bc->lock, 0);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&bc->kick, &attr);
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+
+int bcacheread(BCache *bc, uint32_t block, void *dst) {
+    pthread_mutex_lock(&bc->lock);
+    Buf *b = getbuf(bc, block, 1);
+    if (b) memcpy(dst, b->data, bc->blocksz);
+    pthread_mutex_unlock(&bc->lock);
+    return b ? 0 : -1;
+}
+
+int bcachewrite(BCache *bc, uint32_t block, void *src) {
+    pthread_mutex_lock(&bc->lock);
+    Buf *b = getbuf(bc, block, 0);
+    if (b) {
+        memcpy(b->data, src, bc->blocksz);
+        markdirty(bc, b);
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return b ? 0 : -1;
+}
+
+static int readahead(BCache *bc, uint32_t *blocks, int n) {
+    n = n < bc->maxbufs ? n : bc->maxbufs;
+    Batch *batch = malloc(sizeof(Batch) + n * sizeof(IoReq));
+    if (!batch) return -1;
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (lookup(bc, blocks[i])) continue;
+        Buf *b = getfree(bc);
+        if (!b) break;
+        // keep it off the lru tail while the batch is built
+        touch(bc, b);
+        b->dirty = 0;
+        b->io = &batch->reqs[m];
+        b->batch = batch;
+        batch->reqs[m] = (IoReq){VFS_IO_READ, b->data, (uint64_t)blocks[i] * bc->blocksz, bc->blocksz};
+        rehash(bc, b, blocks[i]);
+        m++;
+    }
+    batch->left = m;
+    if (!m) {
+        free(batch);
+        return 0;
+    }
+    int sent = vfssubmit(bc->bdev, batch->reqs, m);
+    for (int k = sent < 0 ? 0 : sent; k < m; k++)
+        batch->reqs[k] = (IoReq){VFS_IO_READ, 0, 0, 0, -1, 1};
+    bc->misses += m;
+    return m;
+}
+
+// starts reads for the blocks that aren't cached yet without waiting on
+// them; the buffers are hashed straight away and settle on first use
+int bcachereadahead(BCache *bc, uint32_t *blocks, int n) {
+    pthread_mutex_lock(&bc->lock);
+    int m = readahead(bc, blocks, n);
+    pthread_mutex_unlock(&bc->lock);
+    return m;
+}
+
+// reads the blocks that aren't cached yet as one device batch
+int bcacheprefetch(BCache *bc, uint32_t *blocks, int n) {
+    pthread_mutex_lock(&bc->lock);
+    int m = readahead(bc, blocks, n);
+    for (int i = 0; i < n; i++) {
+        Buf *b = lookup(bc, blocks[i]);
+        if (b) settle(bc, b);
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return m;
+}
+
+int bcachecached(BCache *bc, uint32_t block) {
+    pthread_mutex_lock(&bc->lock);
+    int rv = lookup(bc, block) != 0;
+    pthread_mutex_unlock(&bc->lock);
+    return rv;
+}
+
+int bcachedirty(BCache *bc, uint32_t block) {
+    pthread_mutex_lock(&bc->lock);
+    Buf *b = lookup(bc, block);
+    int rv = b && b->dirty;
+    pthread_mutex_unlock(&bc->lock);
+    return rv;
+}
+
+int bcacheflush(BCache *bc) {
+    int rv = 0;
+    pthread_mutex_lock(&bc->lock);
+    for (Buf *b = bc->lru.next; b != &bc->lru; b = b->next)
+        if (b->dirty && writeback(bc, b))
+            rv = -1;
+    pthread_mutex_unlock(&bc->lock);
+    return rv;
+}
+
+static int cmpblock(const void *a, const void *b) {
+    uint32_t x = *(uint32_t *)a;
+    uint32_t y = *(uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// writes back the blocks dirtied at or before cutoff in ascending block
+// order, dropping the lock between batches so readers aren't held up
+static int flushold(BCache *bc, uint64_t cutoff) {
+    uint32_t *blocks = malloc(bc->numdirty * sizeof(uint32_t));
+    if (!blocks) return 0;
+    int n = 0;
+    for (Buf *b = bc->lru.next; b != &bc->lru; b = b->next)
+        if (b->dirty && b->dirtied <= cutoff)
+            blocks[n++] = b->block;
+    qsort(blocks, n, sizeof(uint32_t), cmpblock);
+    int written = 0;
+    for (int i = 0; i < n; i += FLUSH_BATCH) {
+        if (i) {
+            pthread_mutex_unlock(&bc->lock);
+            sched_yield();
+            pthread_mutex_lock(&bc->lock);
+        }
+        for (int k = i; k < n && k < i + FLUSH_BATCH; k++) {
+            // may have been evicted or written back meanwhile
+            Buf *b = lookup(bc, blocks[k]);
+            if (b && b->dirty && !writeback(bc, b))
+                written++;
+        }
+    }
+    free(blocks);
+    return written;
+}
+
+static void *flusher(void *arg) {
+    BCache *bc = arg;
+    pthread_mutex_lock(&bc->lock);
+    while (!bc->stopflusher) {
+        uint64_t wait = bc->flushage ? bc->flushage / 2 + 1 : FLUSH_IDLE_MS;
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += wait / 1000;
+        ts.tv_nsec += wait % 1000 * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&bc->kick, &bc->lock, &ts);
+        if (bc->stopflusher || !bc->numdirty)
+            continue;
+        char *why = "age";
+        uint64_t cutoff = 0;
+        if (bc->flushbytes && (uint64_t)bc->numdirty * bc->blocksz >= bc->flushbytes) {
+            why = "dirty bytes";
+            cutoff = UINT64_MAX;
+        } else if (bc->flushage && nowms() > bc->flushage) {
+            cutoff = nowms() - bc->flushage;
+        }
+        if (!cutoff) continue;
+        int n = flushold(bc, cutoff);
+        if (n) {
+            bc->flushes++;
+            fprintf(stderr, "flusher: wrote %i blocks (%s), %i still dirty\n",
+                    n, why, bc->numdirty);
+        }
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return 0;
+}
+
+// starts a thread writing dirty blocks back once more than flushbytes are
+// dirty or a block has been dirty for flushage ms, 0 disabling either
+int bcachestartflusher(BCache *bc, uint64_t flushbytes, int flushage) {
+    bc->flushbytes = flushbytes;
+    bc->flushage = flushage;
+    if (pthread_create(&bc->flusher, 0, flusher, bc))
+        return -1;
+    bc->hasflusher = 1;
+    return 0;
+}
+
+void bcachefree(BCache *bc) {
+    if (bc->hasflusher) {
+        pthread_mutex_lock(&bc->lock);
+        bc->stopflusher = 1;
+        pthread_cond_signal(&bc->kick);
+        pthread_mutex_unlock(&bc->lock);
+        pthread_join(bc->flusher, 0);
+    }
+    for (Buf *b = bc->lru.next, *next; b != &bc->lru; b = next) {
+        next = b->next;
+        settle(bc, b);
+    }
+    Buf *b = bc->lru.next;
+    while (b != &bc->lru) {
+        Buf *next = b->next;
+        free(b->data);
+        free(b);
+        b = next;
+    }
+    free(bc->buckets);
+    pthread_mutex_destroy(&bc->lock);
+    pthread_cond_destroy(&bc->kick);
+    memset(bc, 0, sizeof(BCache));
+}
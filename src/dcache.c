@@ -0,0 +1,130 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ext2/vfs.h>
+#include <ext2/dcache.h>
+
+static Dentry *buckets[DCACHE_ENTRIES];
+static Dentry lru = {.prev = &lru, .next = &lru}; // most recently used first
+static int numents;
+
+static uint32_t hashname(void *device, Vnum parent, char *name) {
+    uint32_t h = 2166136261u;
+    for (char *c = name; *c; c++)
+        h = (h ^ (uint8_t)*c) * 16777619u;
+    h ^= (uint32_t)parent * 2654435761u;
+    h ^= (uint32_t)(uintptr_t)device >> 4;
+    return h;
+}
+
+static Dentry **bucket(void *device, Vnum parent, char *name) {
+    return &buckets[hashname(device, parent, name) & (DCACHE_ENTRIES - 1)];
+}
+
+static void unlist(Dentry *d) {
+    d->prev->next = d->next;
+    d->next->prev = d->prev;
+}
+
+static void pushfront(Dentry *d) {
+    d->prev = &lru;
+    d->next = lru.next;
+    lru.next->prev = d;
+    lru.next = d;
+}
+
+static Dentry *lookup(void *device, Vnum parent, char *name) {
+    for (Dentry *d = *bucket(device, parent, name); d; d = d->hnext)
+        if (d->device == device && d->parent == parent
+                && strcmp(d->name, name) == 0)
+            return d;
+    return 0;
+}
+
+static void drop(Dentry *d) {
+    Dentry **p = bucket(d->device, d->parent, d->name);
+    while (*p != d)
+        p = &(*p)->hnext;
+    *p = d->hnext;
+    unlist(d);
+    if (!d->negative)
+        vfsrelease(&d->vn);
+    free(d->target);
+    free(d);
+    numents--;
+}
+
+// vn is copied and retained unless the entry is negative
+static void insert(Vnode *parent, char *name, Vnode *vn) {
+    if (numents >= DCACHE_ENTRIES)
+        drop(lru.prev);
+    Dentry *d = malloc(sizeof(Dentry));
+    if (!d) return;
+    d->device = parent->device;
+    d->parent = parent->vnum;
+    strcpy(d->name, name);
+    d->negative = !vn;
+    d->target = 0;
+    if (vn) {
+        d->vn = *vn;
+        vfsretain(&d->vn);
+    }
+    Dentry **b = bucket(d->device, d->parent, name);
+    d->hnext = *b;
+    *b = d;
+    pushfront(d);
+    numents++;
+}
+
+int dcachefind(Vnode *parent, Vnode *dst, char *name) {
+    if (strlen(name) >= MAX_NAME)
+        return -1;
+    // only directories have names worth remembering
+    if ((parent->flags & VFS_DIR) != VFS_DIR)
+        return vfsfind(parent, dst, name);
+    Dentry *d = lookup(parent->device, parent->vnum, name);
+    if (d) {
+        unlist(d);
+        pushfront(d);
+        if (d->negative)
+            return -1;
+        *dst = d->vn;
+        vfsretain(dst);
+        return 0;
+    }
+    if (vfsfind(parent, dst, name)) {
+        insert(parent, name, 0);
+        return -1;
+    }
+    insert(parent, name, dst);
+    return 0;
+}
+
+int dcachelink(Vnode *parent, char *name, Vnode *link, char *dst, int size) {
+    Dentry *d = lookup(parent->device, parent->vnum, name);
+    if (d && d->target) {
+        int len = strlen(d->target);
+        if (len >= size) return -1;
+        memcpy(dst, d->target, len + 1);
+        return len;
+    }
+    int len = vfsread(link, dst, 0, size - 1);
+    if (len < 0) return -1;
+    dst[len] = 0;
+    if (d && !d->negative && d->vn.vnum == link->vnum)
+        d->target = strdup(dst);
+    return len;
+}
+
+void dcacheforget(Vnode *parent, char *name) {
+    Dentry *d = lookup(parent->device, parent->vnum, name);
+    if (d) drop(d);
+}
+
+void dcachepurge(void *device) {
+    for (Dentry *d = lru.next, *next; d != &lru; d = next) {
+        next = d->next;
+        if (d->device == device)
+            drop(d);
+    }
+}
@@ -1,6 +1,8 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <ext2/vfs.h>
+#include <ext2/bcache.h>
 #include <ext2/ext2.h>
 #include <ext2/debug.h>
 
@@ -67,6 +69,9 @@ void dumpsb(Ext2 *ext2) {
     printf("%4sjrnlinode %u\n", "", sb->jrnlinode);
     printf("%4sjrnldev %u\n", "", sb->jrnldev);
     printf("%4sorphan %u\n", "", sb->orphan);
+    printf("%4sdefhashversion %u\n", "", sb->defhashversion);
+    printf("%4sdescsz %u\n", "", sb->descsz);
+    printf("%4sflags %u\n", "", sb->flags);
     printf("Computed:\n");
     printf("%4sinodesz %i\n", "", ext2->inodesz);
     printf("%4snumgroups %i\n", "", ext2->numgroups);
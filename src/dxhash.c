@@ -0,0 +1,140 @@
+#include <stdint.h>
+#include <string.h>
+#include <ext2/dxhash.h>
+
+#define TEA_DELTA 0x9e3779b9
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define ROL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ROL(a, s))
+
+#define K1 0
+#define K2 013240474631u
+#define K3 015666365641u
+
+// the largest hash the kernel hands out, reserved as end of directory
+#define HASH_EOF (0x7fffffffu << 1)
+
+static void teatransform(uint32_t *buf, uint32_t *in) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    for (int n = 0; n < 16; n++) {
+        sum += TEA_DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+static void halfmd4transform(uint32_t *buf, uint32_t *in) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    ROUND(F, a, b, c, d, in[0] + K1, 3);
+    ROUND(F, d, a, b, c, in[1] + K1, 7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1, 3);
+    ROUND(F, d, a, b, c, in[5] + K1, 7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    ROUND(G, a, b, c, d, in[1] + K2, 3);
+    ROUND(G, d, a, b, c, in[3] + K2, 5);
+    ROUND(G, c, d, a, b, in[5] + K2, 9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2, 3);
+    ROUND(G, d, a, b, c, in[2] + K2, 5);
+    ROUND(G, c, d, a, b, in[4] + K2, 9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    ROUND(H, a, b, c, d, in[3] + K3, 3);
+    ROUND(H, d, a, b, c, in[7] + K3, 9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3, 3);
+    ROUND(H, d, a, b, c, in[5] + K3, 9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// the original hash, whose result depends on the signedness of char
+static uint32_t legacyhash(char *name, int len, int unsign) {
+    uint32_t hash;
+    uint32_t hash0 = 0x12a3fe2d;
+    uint32_t hash1 = 0x37abe8f9;
+    for (int i = 0; i < len; i++) {
+        int c = unsign ? (unsigned char)name[i] : (signed char)name[i];
+        hash = hash1 + (hash0 ^ (c * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// packs up to num words of name into buf, padding with the length
+static void strtobuf(char *name, int len, uint32_t *buf, int num, int unsign) {
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+    uint32_t val = pad;
+    if (len > num * 4)
+        len = num * 4;
+    for (int i = 0; i < len; i++) {
+        int c = unsign ? (unsigned char)name[i] : (signed char)name[i];
+        val = c + (val << 8);
+        if (i % 4 == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+uint32_t dxhash(char *name, int len, int version, uint32_t *seed) {
+    uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    uint32_t in[8];
+    uint32_t hash;
+    if (seed && (seed[0] || seed[1] || seed[2] || seed[3]))
+        memcpy(buf, seed, sizeof(buf));
+    int unsign = version >= DX_HASH_LEGACY_UNSIGNED;
+    switch (unsign ? version - 3 : version) {
+    case DX_HASH_LEGACY:
+        hash = legacyhash(name, len, unsign);
+        break;
+    case DX_HASH_HALF_MD4:
+        for (char *p = name; len > 0; len -= 32, p += 32) {
+            strtobuf(p, len, in, 8, unsign);
+            halfmd4transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case DX_HASH_TEA:
+        for (char *p = name; len > 0; len -= 16, p += 16) {
+            strtobuf(p, len, in, 4, unsign);
+            teatransform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    default:
+        return 0;
+    }
+    hash &= ~1u;
+    if (hash == HASH_EOF)
+        hash = HASH_EOF - 2;
+    return hash;
+}
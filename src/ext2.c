@@ -3,8 +3,11 @@
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <ext2/vfs.h>
+#include <ext2/bcache.h>
 #include <ext2/ext2.h>
+#include <ext2/dxhash.h>
 
 #define STATE_VALID 1
 #define STATE_ERROR 2
@@ -28,6 +31,66 @@
 #define EXT2_S_IFREG 0x8000
 #define EXT2_S_IFLNK 0xa000
 
+#define FT_UNKNOWN 0
+#define FT_REG     1
+#define FT_DIR     2
+#define FT_SYMLINK 7
+
+#define INCOMPAT_FILETYPE 0x2
+#define INCOMPAT_EXTENTS 0x40
+#define INCOMPAT_64BIT 0x80
+#define INCOMPAT_FLEX_BG 0x200
+#define INCOMPAT_INLINE_DATA 0x8000
+#define INCOMPAT_SUPPORTED (INCOMPAT_FILETYPE | INCOMPAT_EXTENTS | INCOMPAT_64BIT \
+        | INCOMPAT_FLEX_BG | INCOMPAT_INLINE_DATA)
+
+#define RO_COMPAT_SPARSE_SUPER 0x1
+#define RO_COMPAT_LARGE_FILE 0x2
+#define RO_COMPAT_SUPPORTED (RO_COMPAT_SPARSE_SUPER | RO_COMPAT_LARGE_FILE)
+
+#define COMPAT_DIR_INDEX 0x20
+
+#define SB_UNSIGNED_HASH 0x2
+
+#define EXT2_INDEX_FL 0x1000
+#define EXT4_EXTENTS_FL 0x80000
+#define EXT4_INLINE_DATA_FL 0x10000000
+#define EXT4_EXT_MAGIC 0xf30a
+#define EXT4_EXT_INIT_MAX 32768
+
+#define RELATIME_SECS (24 * 60 * 60)
+
+#define PREFETCH_MAX 64
+#define FIND_BATCH 16
+
+// record length of an entry with an n byte name, 4 byte aligned
+#define DIRENT_LEN(n) ((sizeof(Ext2DirEnt) + (n) + 3) & ~3u)
+
+#define DX_ROOT_INFO 0x18 // past the . and .. entries
+#define DX_NODE_ENTRIES 0x8 // past the empty entry covering the block
+#define DX_MAX_LEVELS 2
+#define DX_MAX_PASSES 8
+#define DIRECT_MAX 32
+#define CREATE_ZERO 1
+#define CREATE_RAW  2
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 64
+#define PLUS_BATCH 64
+#define PREALLOC_BLOCKS 8
+#define PREALLOC_MAX 1024
+#define XATTR_MAGIC 0xea020000
+#define XATTR_INDEX_SYSTEM 7
+#define XATTR_ENTRY_LEN(n) ((sizeof(XattrEntry) + (n) + 3) & ~3u)
+#define INLINE_EXTRA_ISIZE 32
+#define INLINE_DOTDOT 1 // cursor positions of an inline directory
+#define INLINE_ENTRIES 4
+
+// a listed entry's inode and where its stat goes
+typedef struct {
+    uint32_t inum;
+    int slot;
+} PlusSlot;
+
 static uint32_t now() {
     return time(0);
 }
@@ -36,6 +99,39 @@ static int hasformat(int mode, int format) {
     return (mode & format) == format;
 }
 
+// directory entry type byte for an inode mode, 0 without the filetype feature
+static uint8_t fttype(Ext2 *ext2, int mode) {
+    if (!(ext2->sb.featuresreq & INCOMPAT_FILETYPE))
+        return FT_UNKNOWN;
+    switch (mode & VFS_MASK_FMT) {
+    case EXT2_S_IFREG: return FT_REG;
+    case EXT2_S_IFDIR: return FT_DIR;
+    case EXT2_S_IFLNK: return FT_SYMLINK;
+    }
+    return FT_UNKNOWN;
+}
+
+// the vfs format bits an entry type byte stands for, 0 when unknown
+static int ftformat(Ext2 *ext2, uint8_t ft) {
+    if (!(ext2->sb.featuresreq & INCOMPAT_FILETYPE))
+        return 0;
+    switch (ft) {
+    case FT_REG: return VFS_FILE;
+    case FT_DIR: return VFS_DIR;
+    case FT_SYMLINK: return VFS_LINK;
+    }
+    return 0;
+}
+
+// a symlink whose target sits in blocks[] instead of a data block, told
+// apart the way the kernel does: no blocks besides an xattr one
+static int fastlink(Ext2 *ext2, Inode *i) {
+    if ((i->mode & VFS_MASK_FMT) != EXT2_S_IFLNK || (i->flags & EXT4_INLINE_DATA_FL))
+        return 0;
+    uint32_t acl = i->fileacl ? ext2->blocksz / 512 : 0;
+    return i->sectors == acl;
+}
+
 static uint64_t inodesize(Inode *inode) {
     return inode->size;
 }
@@ -44,15 +140,26 @@ static void setinodesize(Inode *inode, uint64_t size) {
     inode->size = size;
 }
 
-static int readdev(Ext2 *ext2, void *dst, int off, int count) {
+static int readdev(Ext2 *ext2, void *dst, int64_t off, int count) {
     int n = vfsread(ext2->bdev, dst, off, count);
     return n < 0 ? n : 0;
 }
 
+// points straight at the device copy of a block when the device is mapped
+// and the cache holds no newer version of it
+static void *mapblock(Ext2 *ext2, uint32_t block) {
+    if (!ext2->bdev->map || bcachedirty(&ext2->bcache, block))
+        return 0;
+    return vfsmap(ext2->bdev, (uint64_t)block * ext2->blocksz, ext2->blocksz);
+}
+
 static int readblock(Ext2 *ext2, uint32_t block, void *dst) {
-    if (readdev(ext2, dst, block * ext2->blocksz, ext2->blocksz))
-        return -1;
-    return 0;
+    void *src = mapblock(ext2, block);
+    if (src) {
+        memcpy(dst, src, ext2->blocksz);
+        return 0;
+    }
+    return bcacheread(&ext2->bcache, block, dst);
 }
 
 static void *allocmemblock(Ext2 *ext) {
@@ -67,11 +174,25 @@ static int readsb(Ext2 *ext2) {
     if (readdev(ext2, &ext2->sb, 1024, sizeof(Superblock)))
         return -1;
     // // TODO: convert to host endianness
+    // unknown required features could mean anything, unknown read-only
+    // ones (checksums and the like) only that we mustn't write
+    uint32_t incompat = ext2->sb.featuresreq & ~INCOMPAT_SUPPORTED;
+    if (incompat) {
+        printf("*** unsupported features %x\n", incompat);
+        return -1;
+    }
+    uint32_t rocompat = ext2->sb.featuresro & ~RO_COMPAT_SUPPORTED;
+    if (rocompat && !(ext2->flags & EXT2_RDONLY)) {
+        printf("*** unsupported read-only features %x, mounting read-only\n", rocompat);
+        ext2->flags |= EXT2_RDONLY;
+    }
     ext2->blocksz = 1024 << ext2->sb.blockszshift;
     ext2->inodesz = ext2->sb.revmajor > REV_0 ? ext2->sb.inodesz : 128;
     ext2->numgroups = (ext2->sb.numblocks + ext2->sb.blockspergroup - 1)
             / ext2->sb.blockspergroup;
     ext2->ppb = ext2->blocksz / 4;
+    ext2->descsz = (ext2->sb.featuresreq & INCOMPAT_64BIT) && ext2->sb.descsz
+            ? ext2->sb.descsz : sizeof(Group);
     return 0;
 }
 
@@ -79,40 +200,40 @@ static uint32_t grouptab(Ext2 *ext2) {
     return ext2->blocksz == 1024 ? 2 : 1;
 }
 
-static int readgroup(Ext2 *ext2, Group *dst, int i) {
-    if (i >= ext2->numgroups)
-        return -1;
-    char *tmp = allocmemblock(ext2);
-    int off = i * sizeof(Group);
-    int block = grouptab(ext2) + off / ext2->blocksz;
-    if (readblock(ext2, block, tmp)) {
-        freememblock(tmp);
+static uint32_t groupsperblock(Ext2 *ext2) {
+    return ext2->blocksz / ext2->descsz;
+}
+
+static uint32_t grouptabblocks(Ext2 *ext2) {
+    return (ext2->numgroups + groupsperblock(ext2) - 1) / groupsperblock(ext2);
+}
+
+static int loadgroups(Ext2 *ext2) {
+    uint32_t nblocks = grouptabblocks(ext2);
+    char *tab = malloc(nblocks * ext2->blocksz);
+    ext2->groupsdirty = calloc(nblocks, 1);
+    if (!tab || !ext2->groupsdirty) {
+        free(tab);
         return -1;
     }
-    memcpy(dst, &tmp[off % ext2->blocksz], sizeof(Group));
-    freememblock(tmp);
+    for (int i = 0; i < nblocks; i++) {
+        if (readblock(ext2, grouptab(ext2) + i, &tab[i * ext2->blocksz])) {
+            free(tab);
+            return -1;
+        }
+    }
+    ext2->groups = tab;
     return 0;
 }
 
-static int readinode(Ext2 *ext2, Inode *dst, uint32_t inum) {
-    int gnum = (inum - 1) / ext2->sb.inodespergroup;
-    Group g;
-    if (readgroup(ext2, &g, gnum))
-        return -1;
-    int idx = (inum - 1) % ext2->sb.inodespergroup;
-    int block = g.indoetab + (idx * ext2->inodesz) / ext2->blocksz;
-    int blockidx = idx % (ext2->blocksz / ext2->inodesz);
-    uint8_t *tmp = allocmemblock(ext2);
-    if (readblock(ext2, block, tmp)) {
-        freememblock(tmp);
+static int readgroup(Ext2 *ext2, Group *dst, int i) {
+    if (i >= ext2->numgroups)
         return -1;
-    }
-    memcpy(dst, &tmp[blockidx * ext2->inodesz], ext2->inodesz);
-    freememblock(tmp);
+    memcpy(dst, &ext2->groups[i * ext2->descsz], sizeof(Group));
     return 0;
 }
 
-static int writedev(Ext2 *ext2, int off, int count, void *src) {
+static int writedev(Ext2 *ext2, int64_t off, int count, void *src) {
     int n = vfswrite(ext2->bdev, off, count, src);
     if (n != count)
         printf("*** wrote %i of %i\n", n, count);
@@ -120,29 +241,33 @@ static int writedev(Ext2 *ext2, int off, int count, void *src) {
 }
 
 static int writeblock(Ext2 *ext2, uint32_t block, void *src) {
-    return writedev(ext2, block * ext2->blocksz, ext2->blocksz, src);
+    return bcachewrite(&ext2->bcache, block, src);
 }
 
 static int writesb(Ext2 *ext2) {
-    return writedev(ext2, 1024, sizeof(Superblock), &ext2->sb);
+    if (writedev(ext2, 1024, sizeof(Superblock), &ext2->sb))
+        return -1;
+    ext2->sbdirty = 0;
+    return 0;
 }
 
 static int writegroup(Ext2 *ext2, int i, Group *src) {
     if (i >= ext2->numgroups)
         return -1;
-    char *tmp = allocmemblock(ext2);
-    int pos = i * sizeof(Group);
-    int block = grouptab(ext2) + pos / ext2->blocksz;
-    if (readblock(ext2, block, tmp)) {
-        freememblock(tmp);
-        return -1;
-    }
-    memcpy(&tmp[pos % ext2->blocksz], src, sizeof(Group));
-    if (writeblock(ext2, block, tmp)) {
-        freememblock(tmp);
-        return -1;
+    memcpy(&ext2->groups[i * ext2->descsz], src, sizeof(Group));
+    ext2->groupsdirty[i / groupsperblock(ext2)] = 1;
+    return 0;
+}
+
+// writes back the descriptor table blocks changed since the last flush
+static int flushgroups(Ext2 *ext2) {
+    char *tab = ext2->groups;
+    for (int i = 0; i < grouptabblocks(ext2); i++) {
+        if (!ext2->groupsdirty[i]) continue;
+        if (writeblock(ext2, grouptab(ext2) + i, &tab[i * ext2->blocksz]))
+            return -1;
+        ext2->groupsdirty[i] = 0;
     }
-    freememblock(tmp);
     return 0;
 }
 
@@ -158,266 +283,2051 @@ static void clearbit(void *buf, int num) {
     ((char *)buf)[num / 8] &= ~(1 << (num % 8));
 }
 
-static int allocblock(Ext2 *ext2) {
-    uint8_t *bitmap = allocmemblock(ext2);
-    int block = -1;
+// bits a group's bitmap covers, the last group may be short
+static uint32_t groupblocks(Ext2 *ext2, int gi) {
+    uint32_t start = gi * ext2->sb.blockspergroup;
+    uint32_t total = ext2->sb.numblocks - ext2->sb.firstblock;
+    uint32_t left = total - start;
+    return left < ext2->sb.blockspergroup ? left : ext2->sb.blockspergroup;
+}
+
+// the resident copy of bitmap block for group gi, read on first use
+static Bitmap *getbitmap(Ext2 *ext2, Bitmap *maps, int gi, uint32_t block) {
+    Bitmap *bm = &maps[gi];
+    if (bm->words)
+        return bm;
+    bm->words = malloc(ext2->blocksz);
+    if (!bm->words)
+        return 0;
+    if (readblock(ext2, block, bm->words)) {
+        free(bm->words);
+        bm->words = 0;
+        return 0;
+    }
+    bm->hint = 0;
+    bm->maxrun = UINT32_MAX;
+    bm->dirty = 0;
+    return bm;
+}
+
+// first clear bit in [from, n), a word at a time, -1 if there is none
+static int findzero(uint64_t *words, uint32_t from, uint32_t n) {
+    for (uint32_t w = from / 64; w * 64 < n; w++) {
+        uint64_t free = ~words[w];
+        if (w == from / 64)
+            free &= ~0ull << (from % 64);
+        if (free) {
+            uint32_t bit = w * 64 + __builtin_ctzll(free);
+            return bit < n ? bit : -1;
+        }
+    }
+    return -1;
+}
+
+// takes the first free bit of a group's bitmap at or after its hint
+static int takebit(Bitmap *bm, uint32_t n) {
+    int bit = findzero(bm->words, bm->hint, n);
+    if (bit < 0) {
+        bm->hint = n;
+        return -1;
+    }
+    setbit(bm->words, bit);
+    bm->hint = bit + 1;
+    bm->dirty = 1;
+    return bit;
+}
+
+static void putbit(Bitmap *bm, uint32_t bit) {
+    clearbit(bm->words, bit);
+    if (bit < bm->hint)
+        bm->hint = bit;
+    bm->maxrun = UINT32_MAX;
+    bm->dirty = 1;
+}
+
+// first set bit in [from, n), n if there is none
+static uint32_t findone(uint64_t *words, uint32_t from, uint32_t n) {
+    for (uint32_t w = from / 64; w * 64 < n; w++) {
+        uint64_t used = words[w];
+        if (w == from / 64)
+            used &= ~0ull << (from % 64);
+        if (used) {
+            uint32_t bit = w * 64 + __builtin_ctzll(used);
+            return bit < n ? bit : n;
+        }
+    }
+    return n;
+}
+
+// first run of clear bits in [from, n) at least want long, or failing
+// that the longest one; -1 if no bit is clear, *len is the run's length
+static int findrun(uint64_t *words, uint32_t from, uint32_t n, uint32_t want, uint32_t *len) {
+    int best = -1;
+    uint32_t bestlen = 0;
+    int start;
+    while (from < n && (start = findzero(words, from, n)) >= 0) {
+        uint32_t end = findone(words, start, n);
+        if (end - start > bestlen) {
+            best = start;
+            bestlen = end - start;
+            if (bestlen >= want)
+                break;
+        }
+        from = end;
+    }
+    *len = bestlen;
+    return best;
+}
+
+// writes changed bitmaps to the block cache
+static int flushbitmaps(Ext2 *ext2) {
     for (int gi = 0; gi < ext2->numgroups; gi++) {
+        Bitmap *maps[] = {&ext2->blockmaps[gi], &ext2->inodemaps[gi]};
+        if (!maps[0]->dirty && !maps[1]->dirty) continue;
+        Group g;
+        if (readgroup(ext2, &g, gi))
+            return -1;
+        uint32_t blocks[] = {g.blockbitmap, g.inodebitmap};
+        for (int k = 0; k < 2; k++) {
+            if (!maps[k]->dirty) continue;
+            if (writeblock(ext2, blocks[k], maps[k]->words))
+                return -1;
+            maps[k]->dirty = 0;
+        }
+    }
+    return 0;
+}
+
+// marks len blocks from bit start of group gi used
+static int takerun(Ext2 *ext2, int gi, Bitmap *bm, uint32_t start, uint32_t len) {
+    Group g;
+    if (readgroup(ext2, &g, gi))
+        return -1;
+    for (uint32_t k = 0; k < len; k++)
+        setbit(bm->words, start + k);
+    if (start == bm->hint)
+        bm->hint = start + len;
+    bm->dirty = 1;
+    // set changes
+    ext2->sb.numfreeblocks -= len;
+    g.freeblocks -= len;
+    ext2->sbdirty = 1;
+    // the bitmap and descriptor stay resident until sync
+    if (writegroup(ext2, gi, &g))
+        return -1;
+    return ext2->sb.firstblock + gi * ext2->sb.blockspergroup + start;
+}
+
+// allocates up to want contiguous blocks and sets *len to how many: at
+// goal when that is free, otherwise the first run long enough from goal's
+// group on, otherwise the longest run there is; groups whose longest run
+// is known to be too short are skipped without a scan
+static int allocrun(Ext2 *ext2, uint32_t goal, uint32_t want, uint32_t *len) {
+    uint32_t bpg = ext2->sb.blockspergroup;
+    int first = 0;
+    if (goal >= ext2->sb.firstblock && goal < ext2->sb.numblocks)
+        first = (goal - ext2->sb.firstblock) / bpg;
+    int bestgi = -1;
+    uint32_t beststart = 0;
+    uint32_t bestlen = 0;
+    for (int k = 0; k < ext2->numgroups; k++) {
+        int gi = (first + k) % ext2->numgroups;
         Group g;
-        if (readgroup(ext2, &g, gi)) goto end;
+        if (readgroup(ext2, &g, gi)) return -1;
         if (!g.freeblocks) continue;
-        if (readblock(ext2, g.blockbitmap, bitmap)) goto end;
-        for (int i = 0; i < ext2->sb.blockspergroup; i++) {
-            if (testbit(bitmap, i)) continue;
-            // set changes
-            ext2->sb.numfreeblocks--;
-            g.freeblocks--;
-            setbit(bitmap, i);
-            // flush changes
-            if (writesb(ext2)) goto end;
-            if (writegroup(ext2, gi, &g)) goto end;
-            if (writeblock(ext2, g.blockbitmap, bitmap)) goto end;
-            // set found block number
-            block = ext2->sb.firstblock + gi * ext2->sb.blockspergroup + i;
-            goto end;
+        Bitmap *bm = getbitmap(ext2, ext2->blockmaps, gi, g.blockbitmap);
+        if (!bm) return -1;
+        uint32_t n = groupblocks(ext2, gi);
+        if (k == 0 && goal >= ext2->sb.firstblock + gi * bpg) {
+            // carrying on right after the previous block beats a longer run
+            uint32_t at = goal - ext2->sb.firstblock - gi * bpg;
+            if (at < n && !testbit(bm->words, at)) {
+                uint32_t end = findone(bm->words, at, n);
+                *len = end - at < want ? end - at : want;
+                return takerun(ext2, gi, bm, at, *len);
+            }
+        }
+        if (bm->maxrun < want && bm->maxrun <= bestlen)
+            continue;
+        uint32_t runlen;
+        int start = findrun(bm->words, bm->hint, n, want, &runlen);
+        if (start < 0) {
+            bm->hint = n;
+            bm->maxrun = 0;
+            continue;
+        }
+        if (runlen >= want) {
+            *len = want;
+            return takerun(ext2, gi, bm, start, want);
+        }
+        // the whole group was searched, runlen is its longest
+        bm->maxrun = runlen;
+        if (runlen > bestlen) {
+            bestgi = gi;
+            beststart = start;
+            bestlen = runlen;
         }
     }
-end:
-    freememblock(bitmap);
-    return block;
+    if (bestgi < 0)
+        return -1;
+    *len = bestlen;
+    return takerun(ext2, bestgi, &ext2->blockmaps[bestgi], beststart, bestlen);
+}
+
+static int freeblock(Ext2 *ext2, uint32_t block) {
+    uint32_t rel = block - ext2->sb.firstblock;
+    int gi = rel / ext2->sb.blockspergroup;
+    int idx = rel % ext2->sb.blockspergroup;
+    Group g;
+    if (gi >= ext2->numgroups || readgroup(ext2, &g, gi)) goto error;
+    Bitmap *bm = getbitmap(ext2, ext2->blockmaps, gi, g.blockbitmap);
+    if (!bm) goto error;
+    if (!testbit(bm->words, idx)) goto unallocated;
+    // set changes
+    putbit(bm, idx);
+    g.freeblocks++;
+    ext2->sb.numfreeblocks++;
+    ext2->sbdirty = 1;
+    // the bitmap and descriptor stay resident until sync
+    if (writegroup(ext2, gi, &g)) goto error;
+    return 0;
+unallocated:
+    printf("*** block %u already free\n", block);
+error:
+    printf("*** couldn't free block %u\n", block);
+    return -1;
 }
 
-static void freeblock(Ext2 *ext2, int block) {
-    // TODO
+// gives back the part of an inode's preallocation window no file block
+// took
+static void prerelease(Ext2 *ext2, Ient *e) {
+    while (e->palen) {
+        e->palen--;
+        freeblock(ext2, e->paphys + e->palen);
+    }
 }
 
-static int writeinode(Ext2 *ext2, uint32_t inum, Inode *src) {
+// locates inum in the inode table
+static int inodeloc(Ext2 *ext2, uint32_t inum, uint32_t *block, int *off) {
+    if (inum == 0 || inum > ext2->sb.numinodes)
+        return -1;
     int gnum = (inum - 1) / ext2->sb.inodespergroup;
     Group g;
     if (readgroup(ext2, &g, gnum))
         return -1;
     int idx = (inum - 1) % ext2->sb.inodespergroup;
-    int block = g.indoetab + (idx * ext2->inodesz) / ext2->blocksz;
-    int blockidx = idx % (ext2->blocksz / ext2->inodesz);
-    uint8_t *tmp = allocmemblock(ext2);
-    if (readblock(ext2, block, tmp)) {
+    *block = g.indoetab + (idx * ext2->inodesz) / ext2->blocksz;
+    *off = (idx % (ext2->blocksz / ext2->inodesz)) * ext2->inodesz;
+    return 0;
+}
+
+static Ient **ibucket(Ext2 *ext2, uint32_t inum) {
+    return &ext2->ibuckets[inum & (EXT2_CACHE_INODES - 1)];
+}
+
+static void iunlist(Ient *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void ipushfront(Ext2 *ext2, Ient *e) {
+    e->prev = &ext2->ilru;
+    e->next = ext2->ilru.next;
+    ext2->ilru.next->prev = e;
+    ext2->ilru.next = e;
+}
+
+static void iunhash(Ext2 *ext2, Ient *e) {
+    Ient **pp = ibucket(ext2, e->inum);
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+}
+
+static int iwriteback(Ext2 *ext2, Ient **ents, int n);
+
+// takes an unreferenced entry off the lru tail, or a fresh one
+static Ient *ifree(Ext2 *ext2) {
+    if (ext2->numients >= EXT2_CACHE_INODES) {
+        for (Ient *e = ext2->ilru.prev; e != &ext2->ilru; e = e->prev) {
+            if (e->refs) continue;
+            if (e->dirty && iwriteback(ext2, &e, 1))
+                return 0;
+            prerelease(ext2, e);
+            iunhash(ext2, e);
+            iunlist(e);
+            return e;
+        }
+    }
+    // all pinned, grow past the limit
+    Ient *e = malloc(sizeof(Ient));
+    if (!e) return 0;
+    e->raw = malloc(ext2->inodesz);
+    if (!e->raw) {
+        free(e);
+        return 0;
+    }
+    ext2->numients++;
+    return e;
+}
+
+static Ient *iget(Ext2 *ext2, uint32_t inum) {
+    for (Ient *e = *ibucket(ext2, inum); e; e = e->hnext) {
+        if (e->inum == inum) {
+            iunlist(e);
+            ipushfront(ext2, e);
+            return e;
+        }
+    }
+    uint32_t block;
+    int off;
+    if (inodeloc(ext2, inum, &block, &off))
+        return 0;
+    Ient *e = ifree(ext2);
+    if (!e) return 0;
+    uint8_t *src = mapblock(ext2, block);
+    uint8_t *tmp = src ? 0 : allocmemblock(ext2);
+    if (tmp && readblock(ext2, block, tmp)) {
         freememblock(tmp);
+        free(e->raw);
+        free(e);
+        ext2->numients--;
+        return 0;
+    }
+    memcpy(e->raw, &(src ? src : tmp)[off], ext2->inodesz);
+    if (tmp) freememblock(tmp);
+    e->inum = inum;
+    e->refs = 0;
+    e->dirty = 0;
+    memset(e->runs, 0, sizeof(e->runs));
+    e->nextrun = 0;
+    e->rafirst = 0;
+    e->rastride = 0;
+    e->rawindow = 0;
+    e->palen = 0;
+    e->pasize = 0;
+    e->pastop = 0;
+    Ient **pp = ibucket(ext2, inum);
+    e->hnext = *pp;
+    *pp = e;
+    ipushfront(ext2, e);
+    return e;
+}
+
+static int cmpient(const void *a, const void *b) {
+    uint32_t x = (*(Ient **)a)->inum;
+    uint32_t y = (*(Ient **)b)->inum;
+    return x < y ? -1 : x > y;
+}
+
+// writes back entries sorted by inum, patching each table block once
+static int iwriteback(Ext2 *ext2, Ient **ents, int n) {
+    uint8_t *tmp = allocmemblock(ext2);
+    uint32_t cur = 0;
+    int rv = 0;
+    for (int i = 0; i < n; i++) {
+        uint32_t block;
+        int off;
+        if (inodeloc(ext2, ents[i]->inum, &block, &off)) goto error;
+        if (block != cur) {
+            if (cur && writeblock(ext2, cur, tmp)) goto error;
+            if (readblock(ext2, block, tmp)) goto error;
+            cur = block;
+        }
+        memcpy(&tmp[off], ents[i]->raw, ext2->inodesz);
+        ents[i]->dirty = 0;
+    }
+    if (cur && writeblock(ext2, cur, tmp)) goto error;
+    goto end;
+error:
+    rv = -1;
+end:
+    freememblock(tmp);
+    return rv;
+}
+
+static int flushinodes(Ext2 *ext2) {
+    Ient **ents = malloc(ext2->numients * sizeof(Ient *));
+    if (!ents) return -1;
+    int n = 0;
+    for (Ient *e = ext2->ilru.next; e != &ext2->ilru; e = e->next)
+        if (e->dirty)
+            ents[n++] = e;
+    qsort(ents, n, sizeof(Ient *), cmpient);
+    int rv = iwriteback(ext2, ents, n);
+    free(ents);
+    return rv;
+}
+
+static int readinode(Ext2 *ext2, Inode *dst, uint32_t inum) {
+    Ient *e = iget(ext2, inum);
+    if (!e) return -1;
+    memcpy(dst, e->raw, sizeof(Inode));
+    return 0;
+}
+
+static int writeinode(Ext2 *ext2, uint32_t inum, Inode *src) {
+    Ient *e = iget(ext2, inum);
+    if (!e) return -1;
+    memcpy(e->raw, src, sizeof(Inode));
+    e->dirty = 1;
+    return 0;
+}
+
+// start of the extended attribute entries in the inode body and the room
+// from there to the end of the inode, 0 if the inode has none
+static char *ibody(Ext2 *ext2, uint8_t *raw, uint32_t *len) {
+    if (ext2->inodesz <= sizeof(Inode) + sizeof(uint32_t))
+        return 0;
+    uint16_t extra = *(uint16_t *)(raw + sizeof(Inode));
+    uint32_t start = sizeof(Inode) + extra + sizeof(uint32_t);
+    if (extra % 4 || start > ext2->inodesz || *(uint32_t *)(raw + start - 4) != XATTR_MAGIC)
+        return 0;
+    *len = ext2->inodesz - start;
+    return (char *)raw + start;
+}
+
+// the system.data attribute holding what doesn't fit blocks[], 0 if absent
+static XattrEntry *inlineattr(char *body, uint32_t len) {
+    uint32_t pos = 0;
+    while (pos + sizeof(uint32_t) <= len && *(uint32_t *)&body[pos]) {
+        XattrEntry *xe = (void *)&body[pos];
+        if (pos + XATTR_ENTRY_LEN(xe->namelen) > len)
+            return 0;
+        if (xe->nameindex == XATTR_INDEX_SYSTEM && xe->namelen == 4
+                && memcmp(xe->name, "data", 4) == 0)
+            return xe->valueinum || xe->valueoff + xe->valuesize > len ? 0 : xe;
+        pos += XATTR_ENTRY_LEN(xe->namelen);
+    }
+    return 0;
+}
+
+// reads inline contents, blocks[] first and the system.data value after it
+static int inlineread(Ext2 *ext2, uint32_t inum, Inode *i, char *dst, int off, int count) {
+    Ient *e = iget(ext2, inum);
+    if (!e) return -1;
+    uint32_t len;
+    char *body = ibody(ext2, e->raw, &len);
+    XattrEntry *xe = body ? inlineattr(body, len) : 0;
+    int cap = sizeof(i->blocks) + (xe ? xe->valuesize : 0);
+    if (off + count > cap)
         return -1;
+    int n = 0;
+    if (off < sizeof(i->blocks)) {
+        n = sizeof(i->blocks) - off < count ? sizeof(i->blocks) - off : count;
+        memcpy(dst, (char *)i->blocks + off, n);
     }
-    src->ctime = now();
-    memcpy(&tmp[blockidx * ext2->inodesz], src, ext2->inodesz);
-    if (writeblock(ext2, block, tmp)) {
-        freememblock(tmp);
+    if (n < count)
+        memcpy(dst + n, body + xe->valueoff + off + n - sizeof(i->blocks), count - n);
+    return count;
+}
+
+// marks i inline with an empty system.data attribute, -1 if the inode
+// body has no room for it
+static int inlinesetup(Ext2 *ext2, uint32_t inum, Inode *i) {
+    Ient *e = iget(ext2, inum);
+    if (!e) return -1;
+    uint8_t *raw = e->raw;
+    uint32_t len = 0;
+    char *body = ibody(ext2, raw, &len);
+    XattrEntry *had = body ? inlineattr(body, len) : 0;
+    if (had && !had->valuesize) {
+        i->flags |= EXT4_INLINE_DATA_FL;
+        return 0;
+    }
+    if (had)
+        return -1;
+    if (!body) {
+        if (ext2->inodesz < sizeof(Inode) + sizeof(uint16_t))
+            return -1;
+        uint16_t *extra = (uint16_t *)(raw + sizeof(Inode));
+        if (!*extra) {
+            memset(extra, 0, INLINE_EXTRA_ISIZE);
+            *extra = INLINE_EXTRA_ISIZE;
+        }
+        uint32_t start = sizeof(Inode) + *extra;
+        if (*extra % 4 || start + sizeof(uint32_t) > ext2->inodesz)
+            return -1;
+        memset(raw + start, 0, ext2->inodesz - start);
+        *(uint32_t *)(raw + start) = XATTR_MAGIC;
+        body = ibody(ext2, raw, &len);
+    }
+    // entries grow from the front, values from the back
+    uint32_t end = 0;
+    uint32_t values = len;
+    while (end + sizeof(uint32_t) <= len && *(uint32_t *)&body[end]) {
+        XattrEntry *xe = (void *)&body[end];
+        if (xe->valuesize && xe->valueoff < values)
+            values = xe->valueoff;
+        end += XATTR_ENTRY_LEN(xe->namelen);
+    }
+    uint32_t need = XATTR_ENTRY_LEN(4);
+    if (end + need + sizeof(uint32_t) > values)
         return -1;
+    XattrEntry *xe = (void *)&body[end];
+    memset(xe, 0, need + sizeof(uint32_t));
+    xe->namelen = 4;
+    xe->nameindex = XATTR_INDEX_SYSTEM;
+    xe->valueoff = len;
+    memcpy(xe->name, "data", 4);
+    e->dirty = 1;
+    i->flags |= EXT4_INLINE_DATA_FL;
+    return 0;
+}
+
+// resizes the system.data value to size bytes, keeping its contents up to
+// there and zeroing the rest; the value is moved below all the others, -1
+// if the inode body has no room for it
+static int inlineresize(Ext2 *ext2, uint32_t inum, uint32_t size) {
+    Ient *e = iget(ext2, inum);
+    if (!e) return -1;
+    uint32_t len;
+    char *body = ibody(ext2, e->raw, &len);
+    XattrEntry *xe = body ? inlineattr(body, len) : 0;
+    if (!xe) return -1;
+    uint32_t voff = xe->valueoff;
+    uint32_t vlen = (xe->valuesize + 3) & ~3u;
+    uint32_t newlen = (size + 3) & ~3u;
+    uint32_t end = 0;
+    uint32_t low = len;
+    while (end + sizeof(uint32_t) <= len && *(uint32_t *)&body[end]) {
+        XattrEntry *x = (void *)&body[end];
+        if (x->valuesize && x->valueoff < low)
+            low = x->valueoff;
+        end += XATTR_ENTRY_LEN(x->namelen);
+    }
+    // entries are followed by a 4 byte terminator
+    if (end + sizeof(uint32_t) + newlen > low + vlen)
+        return -1;
+    char keep[len];
+    uint32_t kept = xe->valuesize < size ? xe->valuesize : size;
+    memcpy(keep, &body[voff], kept);
+    if (vlen) {
+        // the values stored in front of it move up over the hole
+        for (uint32_t p = 0; p < end; p += XATTR_ENTRY_LEN(((XattrEntry *)&body[p])->namelen)) {
+            XattrEntry *x = (void *)&body[p];
+            if (x->valuesize && x->valueoff < voff)
+                x->valueoff += vlen;
+        }
+        memmove(&body[low + vlen], &body[low], voff - low);
+        low += vlen;
+    }
+    xe->valueoff = newlen ? low - newlen : len;
+    xe->valuesize = size;
+    memset(&body[low - newlen], 0, newlen);
+    memcpy(&body[xe->valueoff], keep, kept);
+    e->dirty = 1;
+    return 0;
+}
+
+// drops the inline contents and the system.data attribute, the caller
+// writes i back
+static void inlineremove(Ext2 *ext2, uint32_t inum, Inode *i) {
+    i->flags &= ~EXT4_INLINE_DATA_FL;
+    memset(i->blocks, 0, sizeof(i->blocks));
+    Ient *e = iget(ext2, inum);
+    if (!e) return;
+    uint32_t len;
+    char *body = ibody(ext2, e->raw, &len);
+    XattrEntry *xe = body ? inlineattr(body, len) : 0;
+    if (!xe) return;
+    uint32_t pos = (char *)xe - body;
+    uint32_t elen = XATTR_ENTRY_LEN(xe->namelen);
+    uint32_t voff = xe->valueoff;
+    uint32_t vlen = (xe->valuesize + 3) & ~3u;
+    uint32_t end = pos;
+    while (end + sizeof(uint32_t) <= len && *(uint32_t *)&body[end])
+        end += XATTR_ENTRY_LEN(((XattrEntry *)&body[end])->namelen);
+    memmove(&body[pos], &body[pos + elen], end - pos - elen);
+    memset(&body[end - elen], 0, elen);
+    if (vlen) {
+        // the values stored in front of it move up over the hole
+        uint32_t low = voff;
+        for (uint32_t p = 0; p + sizeof(uint32_t) <= len && *(uint32_t *)&body[p];
+                p += XATTR_ENTRY_LEN(((XattrEntry *)&body[p])->namelen)) {
+            XattrEntry *x = (void *)&body[p];
+            if (x->valuesize && x->valueoff < voff) {
+                low = x->valueoff < low ? x->valueoff : low;
+                x->valueoff += vlen;
+            }
+        }
+        memmove(&body[low + vlen], &body[low], voff - low);
+        memset(&body[low], 0, vlen);
+    }
+    e->dirty = 1;
+}
+
+// whether a regular file that is empty and blockless may take a write
+// ending at end inline; the room left in the inode body is only known
+// once inlinewrite has looked at it
+static int caninline(Ext2 *ext2, Inode *i, uint64_t end) {
+    return (ext2->sb.featuresreq & INCOMPAT_INLINE_DATA)
+            && (i->mode & VFS_MASK_FMT) == EXT2_S_IFREG
+            && !(i->flags & (EXT4_INLINE_DATA_FL | EXT4_EXTENTS_FL))
+            && !i->sectors && !inodesize(i)
+            && end <= sizeof(i->blocks) + ext2->inodesz - sizeof(Inode);
+}
+
+// finds the cached run covering idx, trimmed to start there
+static int maplookup(Ient *e, uint32_t idx, Run *dst) {
+    for (int i = 0; i < EXT2_MAP_RUNS; i++) {
+        Run *r = &e->runs[i];
+        if (r->len && idx >= r->lblock && idx - r->lblock < r->len) {
+            uint32_t d = idx - r->lblock;
+            *dst = (Run){idx, r->pblock + d, r->len - d};
+            return 1;
+        }
     }
-    freememblock(tmp);
     return 0;
 }
 
-static int getinodeblock(Ext2 *ext2, Inode *i, uint32_t inum, int idx, int create) {
-    if (idx < 0) return -1;
-    if (idx * ext2->blocksz >= inodesize(i) && !create) return -1;
-    if (idx < 12) {
-        int block = i->blocks[idx];
-        if (!block && create) {
-            block = allocblock(ext2);
-            if (block < 0) return -1;
-            i->blocks[idx] = block;
-            // will break if not allocated in order
-            i->sectors = (idx + 1) * (ext2->blocksz / 512);
-            if (writeinode(ext2, inum, i)) {
-                freeblock(ext2, block);
-                return -1;
-            }
+static void mapinsert(Ient *e, uint32_t idx, uint32_t block, uint32_t len) {
+    for (int i = 0; i < EXT2_MAP_RUNS; i++) {
+        Run *r = &e->runs[i];
+        if (r->len && r->lblock + r->len == idx && r->pblock + r->len == block) {
+            r->len += len;
+            return;
+        }
+    }
+    e->runs[e->nextrun] = (Run){idx, block, len};
+    e->nextrun = (e->nextrun + 1) % EXT2_MAP_RUNS;
+}
+
+static void mapclear(Ient *e) {
+    memset(e->runs, 0, sizeof(e->runs));
+    e->nextrun = 0;
+}
+
+// length of the physically contiguous stretch starting at ptrs[0]
+static uint32_t runlen(uint32_t *ptrs, int n) {
+    uint32_t len = 1;
+    while (len < n && ptrs[len] && ptrs[len] == ptrs[0] + len)
+        len++;
+    return len;
+}
+
+// first block of the group holding inum, where its blocks are looked for
+// when there is no previous one to follow
+static uint32_t groupgoal(Ext2 *ext2, uint32_t inum) {
+    uint32_t gi = (inum - 1) / ext2->sb.inodespergroup;
+    return ext2->sb.firstblock + gi * ext2->sb.blockspergroup;
+}
+
+// size of the preallocation window: the superblock's count for files or
+// directories, a default where it is 0
+static uint32_t prealloc(Ext2 *ext2, Inode *i) {
+    uint32_t n = hasformat(i->mode, EXT2_S_IFDIR) ? ext2->sb.preallocdir : ext2->sb.preallocfile;
+    return n ? n : PREALLOC_BLOCKS;
+}
+
+// where blocks for file block idx are looked for: right after the
+// previous file block, or in the inode's group for the first one
+static uint32_t datagoal(Ext2 *ext2, Ient *e, Inode *i, uint32_t inum, uint32_t idx) {
+    Run r;
+    if (idx && maplookup(e, idx - 1, &r))
+        return r.pblock + 1;
+    if (idx && idx <= 12 && i->blocks[idx - 1])
+        return i->blocks[idx - 1] + 1;
+    return groupgoal(ext2, inum);
+}
+
+// allocates the device block for file block idx, zeroed unless create is
+// CREATE_RAW; it comes out of the inode's preallocation window when that
+// continues at idx, otherwise a run is taken at datagoal; the run is as
+// long as the rest of the write or the window size and its surplus
+// becomes the new window
+static int allocdatablock(Ext2 *ext2, Inode *i, uint32_t inum, uint32_t idx, int create) {
+    Ient *e = iget(ext2, inum);
+    if (!e) return -1;
+    int block;
+    if (e->palen && e->palogical == idx) {
+        block = e->paphys++;
+        e->palogical++;
+        e->palen--;
+    } else {
+        // a window used up by a stream of writes is followed by a bigger one
+        uint32_t base = prealloc(ext2, i);
+        if (e->pasize && !e->palen && e->palogical == idx)
+            e->pasize = e->pasize * 2 < PREALLOC_MAX ? e->pasize * 2 : PREALLOC_MAX;
+        else
+            e->pasize = base;
+        prerelease(ext2, e);
+        uint32_t goal = datagoal(ext2, e, i, inum, idx);
+        uint32_t want = 1 + e->pasize;
+        if (e->pastop > idx && e->pastop - idx > want)
+            want = e->pastop - idx;
+        if (want > ext2->sb.blockspergroup)
+            want = ext2->sb.blockspergroup;
+        uint32_t len;
+        block = allocrun(ext2, goal, want, &len);
+        if (block < 0) return -1;
+        e->palogical = idx + 1;
+        e->paphys = block + 1;
+        e->palen = len - 1;
+    }
+    if (create != CREATE_RAW) {
+        void *tmp = allocmemblock(ext2);
+        memset(tmp, 0, ext2->blocksz);
+        int rv = writeblock(ext2, block, tmp);
+        freememblock(tmp);
+        if (rv) {
+            freeblock(ext2, block);
+            return -1;
+        }
+    }
+    i->sectors += ext2->blocksz / 512;
+    return block;
+}
+
+// allocates a zeroed indirect block on the way to file block idx, placed
+// like a data block so it sits between the blocks it maps and the ones
+// before; a window continuing at idx gives up its next block for it
+static int alloczeroblock(Ext2 *ext2, Inode *i, uint32_t inum, uint32_t idx) {
+    Ient *e = iget(ext2, inum);
+    if (!e) return -1;
+    int block;
+    if (e->palen && e->palogical == idx) {
+        block = e->paphys++;
+        e->palen--;
+    } else {
+        uint32_t len;
+        block = allocrun(ext2, datagoal(ext2, e, i, inum, idx), 1, &len);
+        if (block < 0) return -1;
+    }
+    void *tmp = allocmemblock(ext2);
+    memset(tmp, 0, ext2->blocksz);
+    int rv = writeblock(ext2, block, tmp);
+    freememblock(tmp);
+    if (rv) {
+        freeblock(ext2, block);
+        return -1;
+    }
+    i->sectors += ext2->blocksz / 512;
+    return block;
+}
+
+// splits file block idx into per-level slot indices, returns the depth
+static int blockpath(Ext2 *ext2, uint32_t idx, uint32_t *slots) {
+    uint32_t ppb = ext2->ppb;
+    if (idx < 12) {
+        slots[0] = idx;
+        return 0;
+    }
+    idx -= 12;
+    if (idx < ppb) {
+        slots[0] = 12;
+        slots[1] = idx;
+        return 1;
+    }
+    idx -= ppb;
+    if (idx < ppb * ppb) {
+        slots[0] = 13;
+        slots[1] = idx / ppb;
+        slots[2] = idx % ppb;
+        return 2;
+    }
+    idx -= ppb * ppb;
+    if (idx / ppb / ppb < ppb) {
+        slots[0] = 14;
+        slots[1] = idx / ppb / ppb;
+        slots[2] = idx / ppb % ppb;
+        slots[3] = idx % ppb;
+        return 3;
+    }
+    return -1;
+}
+
+// finds the extent covering idx, or the hole up to the next one
+static int extentrun(Ext2 *ext2, Inode *i, uint32_t idx, Run *dst) {
+    ExtHeader *h = (ExtHeader *)i->blocks;
+    uint32_t bound = UINT32_MAX;
+    uint8_t *tmp = 0;
+    int rv = -1;
+    for (;;) {
+        if (h->magic != EXT4_EXT_MAGIC) {
+            printf("*** bad extent header\n");
+            goto end;
+        }
+        if (h->depth == 0)
+            break;
+        ExtIdx *ix = (ExtIdx *)(h + 1);
+        int k = 0;
+        while (k + 1 < h->entries && ix[k + 1].block <= idx)
+            k++;
+        if (!h->entries || ix[k].block > idx) {
+            bound = h->entries ? ix[0].block : bound;
+            *dst = (Run){idx, 0, bound - idx};
+            rv = 0;
+            goto end;
+        }
+        if (k + 1 < h->entries)
+            bound = ix[k + 1].block;
+        uint64_t leaf = ix[k].leaflo | (uint64_t)ix[k].leafhi << 32;
+        if (!tmp) tmp = allocmemblock(ext2);
+        if (readblock(ext2, leaf, tmp)) goto end;
+        h = (ExtHeader *)tmp;
+    }
+    Extent *ex = (Extent *)(h + 1);
+    int k = -1;
+    while (k + 1 < h->entries && ex[k + 1].block <= idx)
+        k++;
+    if (k + 1 < h->entries)
+        bound = ex[k + 1].block;
+    *dst = (Run){idx, 0, bound - idx};
+    if (k >= 0) {
+        int uninit = ex[k].len > EXT4_EXT_INIT_MAX;
+        uint32_t len = uninit ? ex[k].len - EXT4_EXT_INIT_MAX : ex[k].len;
+        if (idx - ex[k].block < len) {
+            uint32_t d = idx - ex[k].block;
+            uint64_t start = ex[k].startlo | (uint64_t)ex[k].starthi << 32;
+            // uninitialized extents read back as zeroes
+            *dst = (Run){idx, uninit ? 0 : start + d, len - d};
+        }
+    }
+    rv = 0;
+end:
+    if (tmp) freememblock(tmp);
+    return rv;
+}
+
+// maps file block idx to a device block, 0 for a hole; with create set a
+// hole is filled with a fresh data block, zeroed unless create is
+// CREATE_RAW, and the caller writes the inode back
+static int getinodeblock(Ext2 *ext2, Inode *i, uint32_t inum, int idx, int create) {
+    if (idx < 0) return -1;
+    if ((uint64_t)idx * ext2->blocksz >= inodesize(i) && !create) return -1;
+    // inline contents have no blocks to map
+    if (i->flags & EXT4_INLINE_DATA_FL) return -1;
+    Ient *e = iget(ext2, inum);
+    if (!e) return -1;
+    Run r;
+    if (maplookup(e, idx, &r))
+        return r.pblock;
+    if (i->flags & EXT4_EXTENTS_FL) {
+        if (create) {
+            printf("*** extent mapped files are read-only\n");
+            return -1;
+        }
+        if (extentrun(ext2, i, idx, &r))
+            return -1;
+        if (r.pblock)
+            mapinsert(e, r.lblock, r.pblock, r.len);
+        return r.pblock;
+    }
+    uint32_t slots[4];
+    int depth = blockpath(ext2, idx, slots);
+    if (depth < 0) {
+        printf("*** file too big\n");
+        return -1;
+    }
+    int block = i->blocks[slots[0]];
+    if (!block) {
+        if (!create) return 0;
+        block = depth ? alloczeroblock(ext2, i, inum, idx) : allocdatablock(ext2, i, inum, idx, create);
+        if (block < 0) return -1;
+        i->blocks[slots[0]] = block;
+    }
+    uint32_t len = depth ? 1 : runlen(&i->blocks[slots[0]], 12 - slots[0]);
+    uint32_t *tmp = allocmemblock(ext2);
+    for (int d = 1; d <= depth; d++) {
+        if (readblock(ext2, block, tmp)) goto error;
+        int next = tmp[slots[d]];
+        if (!next) {
+            if (!create) {
+                block = 0;
+                goto end;
+            }
+            next = d < depth ? alloczeroblock(ext2, i, inum, idx) : allocdatablock(ext2, i, inum, idx, create);
+            if (next < 0) goto error;
+            tmp[slots[d]] = next;
+            if (writeblock(ext2, block, tmp)) goto error;
+        }
+        if (d == depth)
+            len = runlen(&tmp[slots[d]], ext2->ppb - slots[d]);
+        block = next;
+    }
+    mapinsert(e, idx, block, len);
+end:
+    freememblock(tmp);
+    return block;
+error:
+    freememblock(tmp);
+    return -1;
+}
+
+// maps file block idx to the run of blocks starting there, pblock 0 for a hole
+static int maprun(Ext2 *ext2, Inode *i, uint32_t inum, uint32_t idx, Run *dst) {
+    if (i->flags & EXT4_INLINE_DATA_FL)
+        return -1;
+    Ient *e = iget(ext2, inum);
+    if (!e) return -1;
+    if (maplookup(e, idx, dst))
+        return 0;
+    if (i->flags & EXT4_EXTENTS_FL) {
+        if (extentrun(ext2, i, idx, dst))
+            return -1;
+        if (dst->pblock)
+            mapinsert(e, dst->lblock, dst->pblock, dst->len);
+        return 0;
+    }
+    int block = getinodeblock(ext2, i, inum, idx, 0);
+    if (block < 0) return -1;
+    if (!block) {
+        *dst = (Run){idx, 0, 1};
+        return 0;
+    }
+    if (!maplookup(e, idx, dst))
+        *dst = (Run){idx, block, 1};
+    return 0;
+}
+
+// reads the blocks backing [off, end) into the cache as one device batch
+static void prefetchrange(Ext2 *ext2, Inode *i, uint32_t inum, int off, int end) {
+    if (ext2->bdev->map || off >= end)
+        return;
+    uint32_t blocks[PREFETCH_MAX];
+    int n = 0;
+    uint32_t idx = off / ext2->blocksz;
+    uint32_t last = (end - 1) / ext2->blocksz;
+    while (idx <= last && n < PREFETCH_MAX) {
+        Run r;
+        if (maprun(ext2, i, inum, idx, &r))
+            break;
+        for (uint32_t k = 0; k < r.len && idx <= last && n < PREFETCH_MAX; k++) {
+            if (r.pblock)
+                blocks[n++] = r.pblock + k;
+            idx++;
+        }
+    }
+    if (n > 1)
+        bcacheprefetch(&ext2->bcache, blocks, n);
+}
+
+// notes a read of file blocks [first, last] and, once the distance between
+// reads repeats, starts reading the blocks the next reads will want; the
+// window doubles while the stride holds and drops to 0 when it breaks;
+// only devices that can queue reads get any, elsewhere the batch would be
+// read before this read returns
+static void readahead(Ext2 *ext2, Inode *i, uint32_t inum, uint32_t first, uint32_t last) {
+    Ient *e = iget(ext2, inum);
+    if (!e) return;
+    int stride = first - e->rafirst;
+    if (stride == 0)
+        return;
+    int span = last - first + 1;
+    int max = ext2->bcache.maxbufs / 4;
+    max = max < READAHEAD_MAX ? max : READAHEAD_MAX;
+    if (stride > 0 && stride == e->rastride) {
+        int w = e->rawindow ? e->rawindow * 2 : READAHEAD_MIN;
+        w = w > span ? w : span;
+        e->rawindow = w < max ? w : max;
+    } else {
+        e->rawindow = 0;
+    }
+    e->rafirst = first;
+    e->rastride = stride;
+    if (!e->rawindow || ext2->bdev->map || !ext2->bdev->submit)
+        return;
+    uint32_t nblocks = (inodesize(i) + ext2->blocksz - 1) / ext2->blocksz;
+    uint32_t blocks[READAHEAD_MAX];
+    int n = 0;
+    // the next reads start stride blocks apart and cover span blocks each
+    for (uint32_t start = first + stride; n < e->rawindow && start < nblocks; start += stride) {
+        uint32_t idx = start > last ? start : last + 1;
+        uint32_t end = start + span;
+        while (idx < end && idx < nblocks && n < e->rawindow) {
+            Run r;
+            if (maprun(ext2, i, inum, idx, &r))
+                goto submit;
+            for (uint32_t k = 0; k < r.len && idx < end && idx < nblocks && n < e->rawindow; k++) {
+                if (r.pblock)
+                    blocks[n++] = r.pblock + k;
+                idx++;
+            }
+        }
+    }
+submit:
+    if (n)
+        bcachereadahead(&ext2->bcache, blocks, n);
+}
+
+// frees an indirect tree of the given depth, 0 being a data block, and
+// adds the number of blocks released to *count
+static int freetree(Ext2 *ext2, uint32_t block, int depth, uint32_t *count) {
+    if (depth > 0) {
+        uint32_t *tmp = allocmemblock(ext2);
+        if (readblock(ext2, block, tmp)) {
+            freememblock(tmp);
+            return -1;
+        }
+        for (int k = 0; k < ext2->ppb; k++) {
+            if (tmp[k] && freetree(ext2, tmp[k], depth - 1, count)) {
+                freememblock(tmp);
+                return -1;
+            }
+        }
+        freememblock(tmp);
+    }
+    (*count)++;
+    return freeblock(ext2, block);
+}
+
+// frees the part of an indirect tree mapping file blocks first and up,
+// base being the first file block under it; *gone is set when the whole
+// tree went
+static int freetreefrom(Ext2 *ext2, uint32_t block, int depth, uint64_t base,
+        uint64_t first, int *gone, uint32_t *count) {
+    *gone = base >= first;
+    if (*gone)
+        return freetree(ext2, block, depth, count);
+    if (depth == 0)
+        return 0;
+    uint64_t span = 1;
+    for (int d = 1; d < depth; d++)
+        span *= ext2->ppb;
+    uint32_t *tmp = allocmemblock(ext2);
+    int rv = -1;
+    if (readblock(ext2, block, tmp))
+        goto end;
+    int changed = 0;
+    for (int k = 0; k < ext2->ppb; k++) {
+        uint64_t b = base + k * span;
+        if (!tmp[k] || b + span <= first)
+            continue;
+        int g;
+        if (freetreefrom(ext2, tmp[k], depth - 1, b, first, &g, count))
+            goto end;
+        if (g) {
+            tmp[k] = 0;
+            changed = 1;
+        }
+    }
+    rv = changed ? writeblock(ext2, block, tmp) : 0;
+end:
+    freememblock(tmp);
+    return rv;
+}
+
+// releases the blocks of an inode from file block first on, the caller
+// writes it back
+static int freeblocksfrom(Ext2 *ext2, Inode *i, uint32_t inum, uint32_t first) {
+    if (fastlink(ext2, i)) {
+        memset(i->blocks, 0, sizeof(i->blocks));
+        return 0;
+    }
+    // an inline inode keeps the layout, just empty
+    if (i->flags & EXT4_INLINE_DATA_FL) {
+        inlineremove(ext2, inum, i);
+        inlinesetup(ext2, inum, i);
+        return 0;
+    }
+    if (i->flags & EXT4_EXTENTS_FL) {
+        printf("*** extent mapped files are read-only\n");
+        return -1;
+    }
+    Ient *e = iget(ext2, inum);
+    if (!e) return -1;
+    mapclear(e);
+    prerelease(ext2, e);
+    uint64_t ppb = ext2->ppb;
+    uint64_t bases[15];
+    for (int k = 0; k < 12; k++)
+        bases[k] = k;
+    bases[12] = 12;
+    bases[13] = bases[12] + ppb;
+    bases[14] = bases[13] + ppb * ppb;
+    uint32_t count = 0;
+    int rv = 0;
+    for (int k = 0; k < 15; k++) {
+        if (!i->blocks[k]) continue;
+        int depth = k < 12 ? 0 : k - 11;
+        int gone;
+        rv = freetreefrom(ext2, i->blocks[k], depth, bases[k], first, &gone, &count);
+        if (rv) break;
+        if (gone) i->blocks[k] = 0;
+    }
+    i->sectors -= count * (ext2->blocksz / 512);
+    return rv;
+}
+
+// releases all blocks of an inode, the caller writes it back
+static int freeinodeblocks(Ext2 *ext2, Inode *i, uint32_t inum) {
+    if (freeblocksfrom(ext2, i, inum, 0))
+        return -1;
+    i->sectors = 0;
+    return 0;
+}
+
+// updates atime after a read as the mount flags ask; relatime only does
+// so when the last access predates the last change or is a day old
+static int touchatime(Ext2 *ext2, uint32_t inum, Inode *i) {
+    if (ext2->flags & (EXT2_NOATIME | EXT2_RDONLY))
+        return 0;
+    uint32_t t = now();
+    if (!(ext2->flags & EXT2_STRICTATIME) && i->atime > i->mtime
+            && i->atime > i->ctime && t - i->atime < RELATIME_SECS)
+        return 0;
+    i->atime = t;
+    return writeinode(ext2, inum, i);
+}
+
+// reads file contents without touching atime, for the filesystem's own
+// reads of directory blocks
+static int readdata(Vnode *vn, void *dst, int64_t off, int count) {
+    Ext2 *ext2 = vn->device;
+    Inode inode;
+    if (readinode(ext2, &inode, vn->vnum))
+        return -1;
+    // if (!(inode.mode & EXT2_S_IFREG))
+    //     return -1;
+    uint64_t isz = inodesize(&inode);
+    if (off >= isz) return 0;
+    if (count <= 0) return 0;
+    count = off + count < isz ? count : isz - off;
+    if (inode.flags & EXT4_INLINE_DATA_FL)
+        return inlineread(ext2, vn->vnum, &inode, dst, off, count);
+    if (fastlink(ext2, &inode)) {
+        if (isz > sizeof(inode.blocks)) return -1;
+        memcpy(dst, (char *)inode.blocks + off, count);
+        return count;
+    }
+    int64_t end = off + count;
+    uint32_t bs = ext2->blocksz;
+    uint32_t first = off / bs;
+    IoReq reqs[DIRECT_MAX];
+    int nreqs = 0;
+    char *tmp = allocmemblock(ext2);
+    while (off < end) {
+        Run r;
+        if (maprun(ext2, &inode, vn->vnum, off / bs, &r))
+            goto error;
+        for (uint32_t k = 0; k < r.len && off < end; k++) {
+            // whole uncached blocks are read straight into dst, one
+            // request per physically contiguous stretch
+            uint32_t n = 0;
+            if (r.pblock && off % bs == 0) {
+                while (k + n < r.len && off + (n + 1) * bs <= end
+                        && !bcachecached(&ext2->bcache, r.pblock + k + n))
+                    n++;
+            }
+            if (n) {
+                if (nreqs == DIRECT_MAX) {
+                    if (vfsbatch(ext2->bdev, reqs, nreqs)) goto error;
+                    nreqs = 0;
+                }
+                reqs[nreqs++] = (IoReq){VFS_IO_READ, dst, (uint64_t)(r.pblock + k) * bs, n * bs};
+                off += n * bs;
+                dst += n * bs;
+                k += n - 1;
+                continue;
+            }
+            char *src = r.pblock ? mapblock(ext2, r.pblock + k) : 0;
+            if (!src) {
+                src = tmp;
+                if (!r.pblock)
+                    memset(tmp, 0, ext2->blocksz);
+                else if (readblock(ext2, r.pblock + k, tmp))
+                    goto error;
+            }
+            int blockoff = off % ext2->blocksz;
+            int blockrem = ext2->blocksz - blockoff;
+            int len = blockrem < end - off ? blockrem : end - off;
+            memcpy(dst, &src[blockoff], len);
+            off += len;
+            dst += len;
+        }
+    }
+    if (nreqs && vfsbatch(ext2->bdev, reqs, nreqs)) goto error;
+    freememblock(tmp);
+    readahead(ext2, &inode, vn->vnum, first, (end - 1) / bs);
+    return count;
+error:
+    freememblock(tmp);
+    return -1;
+}
+
+static int ext2read(Vnode *vn, void *dst, int64_t off, int count) {
+    Ext2 *ext2 = vn->device;
+    Inode inode;
+    if (readinode(ext2, &inode, vn->vnum))
+        return -1;
+    if (touchatime(ext2, vn->vnum, &inode))
+        return -1;
+    return readdata(vn, dst, off, count);
+}
+
+static int ext2readv(Vnode *vn, IoVec *iov, int n, int64_t off) {
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        int r = ext2read(vn, iov[i].base, off + total, iov[i].len);
+        if (r < 0) return total ? total : -1;
+        total += r;
+        if (r < iov[i].len) break;
+    }
+    return total;
+}
+
+static int ext2truncate(Vnode *vn) {
+    Ext2 *ext2 = vn->device;
+    Inode inode;
+    if (readinode(ext2, &inode, vn->vnum))
+        return -1;
+    setinodesize(&inode, 0);
+    if (freeinodeblocks(ext2, &inode, vn->vnum))
+        return -1;
+    inode.mtime = inode.ctime = now();
+    if (writeinode(ext2, vn->vnum, &inode))
+        return -1;
+    return 0;
+}
+
+// writes through the block map, allocating blocks as it goes
+static int blockwrite(Vnode *vn, int64_t off, int count, void *src) {
+    Ext2 *ext2 = vn->device;
+    Inode inode;
+    if (readinode(ext2, &inode, vn->vnum))
+        return -1;
+    // if (!(inode.mode & EXT2_S_IFREG)) {
+    //     printf("*** [%s] not a regular file\n", vn->name);
+    //     return -1;
+    // }
+    if (fastlink(ext2, &inode) && inodesize(&inode)) {
+        printf("*** can't write to a fast symlink\n");
+        return -1;
+    }
+    uint32_t bs = ext2->blocksz;
+    uint32_t sectors = inode.sectors;
+    // lets block allocation size its runs to the whole write, for as long
+    // as the write lasts; the entry is held so it isn't recycled meanwhile
+    Ient *e = iget(ext2, vn->vnum);
+    if (!e) return -1;
+    e->refs++;
+    e->pastop = (off + count + bs - 1) / bs;
+    char *tmp = allocmemblock(ext2);
+    int done = 0;
+    while (done < count) {
+        int64_t pos = off + done;
+        int blockoff = pos % bs;
+        int len = bs - blockoff < count - done ? bs - blockoff : count - done;
+        int relblock = pos / bs;
+        int absblock = 0;
+        if ((uint64_t)relblock * bs < inodesize(&inode))
+            absblock = getinodeblock(ext2, &inode, vn->vnum, relblock, 0);
+        // blocks allocated here are fully written below, never read
+        int fresh = absblock == 0;
+        if (fresh)
+            absblock = getinodeblock(ext2, &inode, vn->vnum, relblock, CREATE_RAW);
+        if (absblock <= 0) {
+            printf("*** block #%i doesn't exist\n", relblock);
+            break;
+        }
+        char *data = (char *)src + done;
+        if (len < bs) {
+            if (fresh)
+                memset(tmp, 0, bs);
+            else if (readblock(ext2, absblock, tmp))
+                break;
+            memcpy(&tmp[blockoff], data, len);
+            data = tmp;
+        }
+        if (writeblock(ext2, absblock, data))
+            break;
+        done += len;
+    }
+    freememblock(tmp);
+    e->pastop = 0;
+    e->refs--;
+    if (!done && inode.sectors == sectors)
+        return count ? -1 : 0;
+    uint64_t newsize = inodesize(&inode);
+    newsize = off + done > newsize ? off + done : newsize;
+    setinodesize(&inode, newsize);
+    inode.mtime = inode.ctime = now();
+    if (writeinode(ext2, vn->vnum, &inode))
+        return -1;
+    return done ? done : -1;
+}
+
+// writes into inline contents while they fit blocks[] and the system.data
+// value, returns 1 once they have moved to a block and the write is the
+// block path's to do
+static int inlinewrite(Vnode *vn, Inode *i, int64_t off, int count, void *src) {
+    Ext2 *ext2 = vn->device;
+    if (!(i->flags & EXT4_INLINE_DATA_FL) && inlinesetup(ext2, vn->vnum, i))
+        return 1;
+    uint64_t size = inodesize(i);
+    uint64_t end = off + count > size ? off + count : size;
+    uint32_t nb = sizeof(i->blocks);
+    if (end <= nb || (end - nb < ext2->inodesz && !inlineresize(ext2, vn->vnum, end - nb))) {
+        char *data = (char *)i->blocks;
+        if (off > size && size < nb)
+            memset(data + size, 0, (off < nb ? off : nb) - size);
+        // the part past blocks[] goes to the value, whose new tail
+        // inlineresize zeroed
+        int n = off < nb ? (nb - off < count ? nb - off : count) : 0;
+        if (n)
+            memcpy(data + off, src, n);
+        if (n < count) {
+            Ient *e = iget(ext2, vn->vnum);
+            if (!e) return -1;
+            uint32_t len = 0;
+            char *body = ibody(ext2, e->raw, &len);
+            XattrEntry *xe = inlineattr(body, len);
+            memcpy(body + xe->valueoff + off + n - nb, (char *)src + n, count - n);
+            e->dirty = 1;
+        }
+        setinodesize(i, end);
+        i->mtime = i->ctime = now();
+        return writeinode(ext2, vn->vnum, i);
+    }
+    // too big for the inode, the old contents go to a block first
+    char *old = allocmemblock(ext2);
+    int rv = -1;
+    if (inlineread(ext2, vn->vnum, i, old, 0, size) != size)
+        goto end;
+    inlineremove(ext2, vn->vnum, i);
+    setinodesize(i, 0);
+    if (writeinode(ext2, vn->vnum, i))
+        goto end;
+    if (size && blockwrite(vn, 0, size, old) != size)
+        goto end;
+    rv = 1;
+end:
+    freememblock(old);
+    return rv;
+}
+
+static int ext2write(Vnode *vn, int64_t off, int count, void *src) {
+    Ext2 *ext2 = vn->device;
+    Inode inode;
+    if (readinode(ext2, &inode, vn->vnum))
+        return -1;
+    if ((inode.flags & EXT4_INLINE_DATA_FL) || caninline(ext2, &inode, off + count)) {
+        int rv = inlinewrite(vn, &inode, off, count, src);
+        if (rv <= 0)
+            return rv ? -1 : count;
+    }
+    return blockwrite(vn, off, count, src);
+}
+
+static int fillvnode(Ext2 *ext2, Vnode *dst, uint32_t inum);
+static int entryvnode(Ext2 *ext2, Vnode *dst, uint32_t inum, int type);
+
+// lists an inline directory: . and .. come first, from the parent inode
+// number at the start of blocks[], then the records after it and those in
+// the system.data value, the cursor being the offset into both together
+static int inlinereaddir(Vnode *parent, Inode *i, int64_t *off, DirEnt *dst, int n) {
+    Ext2 *ext2 = parent->device;
+    uint64_t size = inodesize(i);
+    uint32_t head = sizeof(i->blocks);
+    char *buf = allocmemblock(ext2);
+    int got = -1;
+    if (size < INLINE_ENTRIES || size > ext2->blocksz
+            || inlineread(ext2, parent->vnum, i, buf, 0, size) != size)
+        goto end;
+    got = 0;
+    while (got < n && *off < size) {
+        if (*off <= INLINE_DOTDOT) {
+            strcpy(dst[got].name, *off ? ".." : ".");
+            dst[got].vnum = *off ? *(uint32_t *)buf : parent->vnum;
+            dst[got].type = VFS_DIR;
+            got++;
+            *off = *off ? INLINE_ENTRIES : INLINE_DOTDOT;
+            continue;
+        }
+        if (*off < INLINE_ENTRIES)
+            *off = INLINE_ENTRIES;
+        // records don't run from blocks[] into the attribute value
+        uint32_t limit = *off < head && size > head ? head : size;
+        Ext2DirEnt *de = (void *)&buf[*off];
+        if (*off + sizeof(Ext2DirEnt) > limit || de->reclen < sizeof(Ext2DirEnt)
+                || *off + de->reclen > limit) {
+            *off = limit;
+            continue;
+        }
+        if (de->inum && de->namelen) {
+            memcpy(dst[got].name, de->name, de->namelen);
+            dst[got].name[de->namelen] = 0;
+            dst[got].vnum = de->inum;
+            dst[got].type = ftformat(ext2, de->filetype);
+            got++;
+        }
+        *off += de->reclen;
+    }
+end:
+    freememblock(buf);
+    return got;
+}
+
+// fills up to n entries from byte offset *off on, leaving *off past the
+// last entry returned; atime is left alone, as for readdata
+static int listdir(Vnode *parent, int64_t *off, DirEnt *dst, int n) {
+    if (!(parent->flags & VFS_DIR))
+        return -1;
+    Ext2 *ext2 = parent->device;
+    Inode inode;
+    if (readinode(ext2, &inode, parent->vnum))
+        return -1;
+    if (inode.flags & EXT4_INLINE_DATA_FL)
+        return inlinereaddir(parent, &inode, off, dst, n);
+    uint64_t size = inodesize(&inode);
+    uint32_t bs = ext2->blocksz;
+    char *tmp = allocmemblock(ext2);
+    int got = 0;
+    while (got < n && *off < size) {
+        uint32_t idx = *off / bs;
+        Run r;
+        if (maprun(ext2, &inode, parent->vnum, idx, &r))
+            goto error;
+        char *blk = r.pblock ? mapblock(ext2, r.pblock) : 0;
+        if (!blk) {
+            blk = tmp;
+            if (!r.pblock)
+                memset(tmp, 0, bs);
+            else if (readblock(ext2, r.pblock, tmp))
+                goto error;
+        }
+        readahead(ext2, &inode, parent->vnum, idx, idx);
+        uint32_t boff = *off % bs;
+        while (boff < bs && got < n) {
+            Ext2DirEnt *de = (void *)&blk[boff];
+            // a damaged record ends the block rather than the scan
+            if (de->reclen < sizeof(Ext2DirEnt) || boff + de->reclen > bs) {
+                boff = bs;
+                break;
+            }
+            if (de->inum && de->namelen) {
+                memcpy(dst[got].name, de->name, de->namelen);
+                dst[got].name[de->namelen] = 0;
+                dst[got].vnum = de->inum;
+                dst[got].type = ftformat(ext2, de->filetype);
+                got++;
+            }
+            boff += de->reclen;
+        }
+        *off = (int64_t)idx * bs + boff;
+    }
+    freememblock(tmp);
+    return got;
+error:
+    freememblock(tmp);
+    return got ? got : -1;
+}
+
+static int ext2readdir(Vnode *parent, int64_t *off, DirEnt *dst, int n) {
+    Ext2 *ext2 = parent->device;
+    Inode inode;
+    if (readinode(ext2, &inode, parent->vnum))
+        return -1;
+    if (touchatime(ext2, parent->vnum, &inode))
+        return -1;
+    return listdir(parent, off, dst, n);
+}
+
+// finds the live entry called name in a directory block, *prev is set to
+// the record before it or 0 when it comes first
+static Ext2DirEnt *blockfind(char *buf, uint32_t bs, char *name, int len, Ext2DirEnt **prev) {
+    Ext2DirEnt *last = 0;
+    uint32_t pos = 0;
+    while (pos + sizeof(Ext2DirEnt) <= bs) {
+        Ext2DirEnt *de = (void *)&buf[pos];
+        if (de->reclen < sizeof(Ext2DirEnt) || pos + de->reclen > bs)
+            break;
+        if (de->inum && de->namelen == len && memcmp(de->name, name, len) == 0) {
+            if (prev) *prev = last;
+            return de;
+        }
+        last = de;
+        pos += de->reclen;
+    }
+    return 0;
+}
+
+// puts an entry into the first record of a directory block with enough
+// slack behind it, -1 if none has
+static int blockadd(char *buf, uint32_t bs, char *name, int len, uint32_t inum, uint8_t ft) {
+    uint32_t need = DIRENT_LEN(len);
+    uint32_t pos = 0;
+    while (pos + sizeof(Ext2DirEnt) <= bs) {
+        Ext2DirEnt *de = (void *)&buf[pos];
+        if (de->reclen < sizeof(Ext2DirEnt) || pos + de->reclen > bs)
+            return -1;
+        uint32_t used = de->inum ? DIRENT_LEN(de->namelen) : 0;
+        if (de->reclen - used >= need) {
+            Ext2DirEnt *ne = (void *)&buf[pos + used];
+            uint32_t reclen = de->reclen - used;
+            if (used) de->reclen = used;
+            ne->inum = inum;
+            ne->reclen = reclen;
+            ne->namelen = len;
+            ne->filetype = ft;
+            memcpy(ne->name, name, len);
+            return 0;
+        }
+        pos += de->reclen;
+    }
+    return -1;
+}
+
+// lays entries out densely from the start of buf, the last one running
+// to the end of the block
+static void packentries(char *buf, uint32_t bs, Ext2DirEnt **ents, int n) {
+    memset(buf, 0, bs);
+    Ext2DirEnt *de = (void *)buf;
+    de->reclen = bs;
+    uint32_t pos = 0;
+    for (int i = 0; i < n; i++) {
+        de = (void *)&buf[pos];
+        memcpy(de, ents[i], sizeof(Ext2DirEnt) + ents[i]->namelen);
+        de->reclen = DIRENT_LEN(ents[i]->namelen);
+        pos += de->reclen;
+    }
+    if (n) de->reclen += bs - pos;
+}
+
+static int readdirblock(Vnode *dir, uint32_t idx, char *buf) {
+    Ext2 *ext2 = dir->device;
+    int n = readdata(dir, buf, idx * ext2->blocksz, ext2->blocksz);
+    return n == ext2->blocksz ? 0 : -1;
+}
+
+static int writedirblock(Vnode *dir, uint32_t idx, char *buf) {
+    Ext2 *ext2 = dir->device;
+    int n = ext2write(dir, idx * ext2->blocksz, ext2->blocksz, buf);
+    return n == ext2->blocksz ? 0 : -1;
+}
+
+// next free directory block number
+static int dirend(Vnode *dir, uint32_t *idx) {
+    Ext2 *ext2 = dir->device;
+    Inode inode;
+    if (readinode(ext2, &inode, dir->vnum))
+        return -1;
+    *idx = (inodesize(&inode) + ext2->blocksz - 1) / ext2->blocksz;
+    return 0;
+}
+
+static int dxindexed(Ext2 *ext2, Inode *i) {
+    return (i->flags & EXT2_INDEX_FL) && (ext2->sb.featuresopt & COMPAT_DIR_INDEX);
+}
+
+static int setindexed(Vnode *dir, int on) {
+    Ext2 *ext2 = dir->device;
+    Inode inode;
+    if (readinode(ext2, &inode, dir->vnum))
+        return -1;
+    if (on)
+        inode.flags |= EXT2_INDEX_FL;
+    else
+        inode.flags &= ~EXT2_INDEX_FL;
+    return writeinode(ext2, dir->vnum, &inode);
+}
+
+// an index node on the lookup path
+typedef struct {
+    uint32_t block;
+    char *buf;
+    DxEntry *entries;
+    DxEntry *at; // entry the lookup followed
+} DxFrame;
+
+static void dxfree(DxFrame *frames, int n) {
+    for (int k = 0; k < n; k++)
+        freememblock(frames[k].buf);
+}
+
+// the last entry of a node whose hash isn't above hash
+static DxEntry *dxsearch(DxEntry *entries, uint32_t hash) {
+    int lo = 1;
+    int hi = ((DxCountLimit *)entries)->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (entries[mid].hash > hash)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return &entries[lo - 1];
+}
+
+// walks the index of dir from the root down to the leaf for name, filling
+// in its hash and the hash version; -1 if the index is damaged or of a
+// kind we don't know, the caller frees the *n frames either way
+static int dxprobe(Vnode *dir, char *name, uint32_t *hash, int *version, DxFrame *frames, int *n) {
+    Ext2 *ext2 = dir->device;
+    uint32_t bs = ext2->blocksz;
+    *n = 0;
+    char *buf = allocmemblock(ext2);
+    frames[(*n)++] = (DxFrame){0, buf};
+    if (readdirblock(dir, 0, buf))
+        return -1;
+    DxRootInfo *info = (void *)&buf[DX_ROOT_INFO];
+    if (info->reserved || info->infolen != sizeof(DxRootInfo)
+            || info->levels >= DX_MAX_LEVELS || info->hashversion > DX_HASH_TEA)
+        return -1;
+    *version = info->hashversion;
+    if (ext2->sb.flags & SB_UNSIGNED_HASH)
+        *version += DX_HASH_LEGACY_UNSIGNED;
+    *hash = dxhash(name, strlen(name), *version, ext2->sb.hashseed);
+    DxEntry *entries = (void *)&buf[DX_ROOT_INFO + info->infolen];
+    uint32_t limit = (bs - DX_ROOT_INFO - info->infolen) / sizeof(DxEntry);
+    for (int level = 0; ; level++) {
+        DxCountLimit *cl = (void *)entries;
+        if (cl->limit != limit || cl->count == 0 || cl->count > limit)
+            return -1;
+        frames[*n - 1].entries = entries;
+        frames[*n - 1].at = dxsearch(entries, *hash);
+        if (level == info->levels)
+            return 0;
+        uint32_t block = frames[*n - 1].at->block;
+        buf = allocmemblock(ext2);
+        frames[(*n)++] = (DxFrame){block, buf};
+        if (readdirblock(dir, block, buf))
+            return -1;
+        entries = (void *)&buf[DX_NODE_ENTRIES];
+        limit = (bs - DX_NODE_ENTRIES) / sizeof(DxEntry);
+    }
+}
+
+// moves the path on to the next leaf if names hashing to hash continue
+// there, 1 if it did
+static int dxnext(Vnode *dir, DxFrame *frames, int n, uint32_t hash) {
+    int k = n - 1;
+    while (k >= 0) {
+        DxFrame *f = &frames[k];
+        if (f->at + 1 < f->entries + ((DxCountLimit *)f->entries)->count)
+            break;
+        k--;
+    }
+    if (k < 0) return 0;
+    frames[k].at++;
+    uint32_t next = frames[k].at->hash;
+    if (!(next & 1) || (next & ~1u) != hash)
+        return 0;
+    for (k++; k < n; k++) {
+        frames[k].block = frames[k - 1].at->block;
+        if (readdirblock(dir, frames[k].block, frames[k].buf))
+            return -1;
+        frames[k].entries = (void *)&frames[k].buf[DX_NODE_ENTRIES];
+        frames[k].at = frames[k].entries;
+    }
+    return 1;
+}
+
+// looks name up through the index: 1 with its inode, type byte unless ft
+// is 0, and leaf block if found, 0 if not, -1 if the index can't be used
+static int dxfind(Vnode *dir, char *name, uint32_t *inum, uint8_t *ft, uint32_t *leaf) {
+    Ext2 *ext2 = dir->device;
+    DxFrame frames[DX_MAX_LEVELS];
+    int n;
+    uint32_t hash;
+    int version;
+    char *buf = allocmemblock(ext2);
+    int rv = -1;
+    if (dxprobe(dir, name, &hash, &version, frames, &n))
+        goto end;
+    do {
+        *leaf = frames[n - 1].at->block;
+        if (readdirblock(dir, *leaf, buf))
+            goto end;
+        Ext2DirEnt *de = blockfind(buf, ext2->blocksz, name, strlen(name), 0);
+        if (de) {
+            *inum = de->inum;
+            if (ft) *ft = de->filetype;
+            rv = 1;
+            goto end;
+        }
+    } while ((rv = dxnext(dir, frames, n, hash)) > 0);
+end:
+    dxfree(frames, n);
+    freememblock(buf);
+    return rv;
+}
+
+typedef struct {
+    uint32_t hash;
+    Ext2DirEnt *de;
+} DxSort;
+
+static int cmpdxsort(const void *a, const void *b) {
+    uint32_t x = ((DxSort *)a)->hash;
+    uint32_t y = ((DxSort *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+// moves the upper half of a full leaf, by hash, into a new block and
+// adds that block to the leaf's parent node, which has room for it
+static int dxsplit(Vnode *dir, DxFrame *f, char *leaf, int version) {
+    Ext2 *ext2 = dir->device;
+    uint32_t bs = ext2->blocksz;
+    DxSort *ents = malloc(bs / sizeof(Ext2DirEnt) * sizeof(DxSort));
+    Ext2DirEnt **order = malloc(bs / sizeof(Ext2DirEnt) * sizeof(Ext2DirEnt *));
+    char *kept = allocmemblock(ext2);
+    char *moved = allocmemblock(ext2);
+    int rv = -1;
+    int n = 0;
+    uint32_t total = 0;
+    uint32_t pos = 0;
+    while (pos + sizeof(Ext2DirEnt) <= bs) {
+        Ext2DirEnt *de = (void *)&leaf[pos];
+        if (de->reclen < sizeof(Ext2DirEnt) || pos + de->reclen > bs)
+            break;
+        if (de->inum) {
+            ents[n++] = (DxSort){dxhash(de->name, de->namelen, version, ext2->sb.hashseed), de};
+            total += DIRENT_LEN(de->namelen);
+        }
+        pos += de->reclen;
+    }
+    if (n < 2) goto end;
+    qsort(ents, n, sizeof(DxSort), cmpdxsort);
+    int split = 0;
+    for (uint32_t size = 0; split < n - 1 && size < total / 2; split++)
+        size += DIRENT_LEN(ents[split].de->namelen);
+    split = split ? split : 1;
+    uint32_t splithash = ents[split].hash;
+    // names hashing alike continue in the new block
+    if (splithash == ents[split - 1].hash)
+        splithash |= 1;
+    for (int i = 0; i < n; i++)
+        order[i] = ents[i].de;
+    packentries(kept, bs, order, split);
+    packentries(moved, bs, order + split, n - split);
+    uint32_t newblock;
+    if (dirend(dir, &newblock)) goto end;
+    if (writedirblock(dir, newblock, moved)) goto end;
+    if (writedirblock(dir, f->at->block, kept)) goto end;
+    DxCountLimit *cl = (void *)f->entries;
+    DxEntry *at = f->at + 1;
+    memmove(at + 1, at, (f->entries + cl->count - at) * sizeof(DxEntry));
+    *at = (DxEntry){splithash, newblock};
+    cl->count++;
+    rv = writedirblock(dir, f->block, f->buf);
+end:
+    free(ents);
+    free(order);
+    freememblock(kept);
+    freememblock(moved);
+    return rv;
+}
+
+// lays count entries out as an index node in node
+static void dxfillnode(char *node, uint32_t bs, DxEntry *entries, int count) {
+    memset(node, 0, bs);
+    // an empty entry over the whole block hides the node from readdir
+    ((Ext2DirEnt *)node)->reclen = bs;
+    DxEntry *ne = (void *)&node[DX_NODE_ENTRIES];
+    memcpy(ne, entries, count * sizeof(DxEntry));
+    DxCountLimit *cl = (void *)ne;
+    cl->limit = (bs - DX_NODE_ENTRIES) / sizeof(DxEntry);
+    cl->count = count;
+}
+
+// writes count entries as a new index node, returning its block number
+static int dxnewnode(Vnode *dir, DxEntry *entries, int count, uint32_t *block) {
+    Ext2 *ext2 = dir->device;
+    char *node = allocmemblock(ext2);
+    dxfillnode(node, ext2->blocksz, entries, count);
+    int rv = -1;
+    if (!dirend(dir, block) && !writedirblock(dir, *block, node))
+        rv = 0;
+    freememblock(node);
+    return rv;
+}
+
+// makes room in the full node at the bottom of the path, adding a level
+// under the root or splitting the node; 1 if the tree can't grow
+static int dxgrow(Vnode *dir, DxFrame *frames, int n) {
+    DxFrame *root = &frames[0];
+    DxCountLimit *rcl = (void *)root->entries;
+    uint32_t block;
+    if (n == 1) {
+        if (dxnewnode(dir, root->entries, rcl->count, &block))
+            return -1;
+        rcl->count = 1;
+        root->entries[0].block = block;
+        ((DxRootInfo *)&root->buf[DX_ROOT_INFO])->levels = 1;
+        return writedirblock(dir, 0, root->buf);
+    }
+    if (rcl->count == rcl->limit)
+        return 1;
+    DxFrame *f = &frames[n - 1];
+    DxCountLimit *cl = (void *)f->entries;
+    int keep = cl->count / 2;
+    uint32_t splithash = f->entries[keep].hash;
+    if (dxnewnode(dir, f->entries + keep, cl->count - keep, &block))
+        return -1;
+    cl->count = keep;
+    if (writedirblock(dir, f->block, f->buf))
+        return -1;
+    DxEntry *at = root->at + 1;
+    memmove(at + 1, at, (root->entries + rcl->count - at) * sizeof(DxEntry));
+    *at = (DxEntry){splithash, block};
+    rcl->count++;
+    return writedirblock(dir, 0, root->buf);
+}
+
+// adds an entry through the index, 1 if the index is full or can't be
+// used and the caller should fall back to a linear insert
+static int dxadd(Vnode *dir, char *name, uint32_t inum, uint8_t ft) {
+    Ext2 *ext2 = dir->device;
+    char *leaf = allocmemblock(ext2);
+    DxFrame frames[DX_MAX_LEVELS];
+    int n = 0;
+    int rv = 1;
+    // every pass inserts or makes room for the next one to
+    for (int pass = 0; pass < DX_MAX_PASSES; pass++) {
+        dxfree(frames, n);
+        uint32_t hash;
+        int version;
+        if (dxprobe(dir, name, &hash, &version, frames, &n)) {
+            rv = 1;
+            break;
         }
-        else if (!block) {
-            return -1;
+        DxFrame *f = &frames[n - 1];
+        if (readdirblock(dir, f->at->block, leaf)) {
+            rv = -1;
+            break;
         }
-        return block;
+        if (!blockadd(leaf, ext2->blocksz, name, strlen(name), inum, ft)) {
+            rv = writedirblock(dir, f->at->block, leaf);
+            break;
+        }
+        DxCountLimit *cl = (void *)f->entries;
+        rv = cl->count == cl->limit ? dxgrow(dir, frames, n) : dxsplit(dir, f, leaf, version);
+        if (rv) break;
+        rv = 1;
     }
-    printf("*** file too big\n");
-    return -1;
+    dxfree(frames, n);
+    freememblock(leaf);
+    return rv;
 }
 
-static int ext2read(Vnode *vn, void *dst, int off, int count) {
-    Ext2 *ext2 = vn->device;
-    Inode inode;
-    if (readinode(ext2, &inode, vn->vnum))
-        return -1;
-    inode.atime = now();
-    if (writeinode(ext2, vn->vnum, &inode))
-        return -1;
-    // if (!(inode.mode & EXT2_S_IFREG))
-    //     return -1;
-    uint64_t isz = inodesize(&inode);
-    if (off >= isz) return 0;
-    if (count <= 0) return 0;
-    count = off + count < isz ? count : isz - off;
-    int end = off + count;
-    char *tmp = allocmemblock(ext2);
-    while (off < end) {
-        int relblock = off / ext2->blocksz;
-        int absblock = getinodeblock(ext2, &inode, vn->vnum, relblock, 0);
-        if (absblock < 0) goto error;
-        if (readblock(ext2, absblock, tmp)) goto error;
-        int blockoff = off % ext2->blocksz;
-        int blockrem = ext2->blocksz - blockoff;
-        int len = blockrem < end - off ? blockrem : end - off;
-        memcpy(dst, &tmp[blockoff], len);
-        off += len;
-        dst += len;
+// makes block 0, holding . and .., the root of an index of the given hash
+// version and levels, and returns its still empty entries
+static DxEntry *dxinitroot(char *root, uint32_t bs, int version, int levels) {
+    Ext2DirEnt *dot = (void *)root;
+    Ext2DirEnt *dotdot = (void *)&root[dot->reclen];
+    dotdot->reclen = bs - dot->reclen;
+    memset(&root[DX_ROOT_INFO], 0, bs - DX_ROOT_INFO);
+    DxRootInfo *info = (void *)&root[DX_ROOT_INFO];
+    info->hashversion = version;
+    info->infolen = sizeof(DxRootInfo);
+    info->levels = levels;
+    DxCountLimit *cl = (void *)&root[DX_ROOT_INFO + sizeof(DxRootInfo)];
+    cl->limit = (bs - DX_ROOT_INFO - sizeof(DxRootInfo)) / sizeof(DxEntry);
+    return (DxEntry *)cl;
+}
+
+// turns a directory whose single block is full into an indexed one: the
+// entries move to a new leaf and block 0 becomes the root over it
+static int dxconvert(Vnode *dir) {
+    Ext2 *ext2 = dir->device;
+    uint32_t bs = ext2->blocksz;
+    char *root = allocmemblock(ext2);
+    char *leaf = allocmemblock(ext2);
+    Ext2DirEnt **ents = malloc(bs / sizeof(Ext2DirEnt) * sizeof(Ext2DirEnt *));
+    int rv = -1;
+    if (readdirblock(dir, 0, root)) goto end;
+    Ext2DirEnt *dot = (void *)root;
+    Ext2DirEnt *dotdot = (void *)&root[dot->reclen];
+    if (dot->reclen != DIRENT_LEN(1) || dot->namelen != 1 || dot->name[0] != '.'
+            || dotdot->namelen != 2 || memcmp(dotdot->name, "..", 2))
+        goto end;
+    int n = 0;
+    uint32_t pos = dot->reclen + dotdot->reclen;
+    while (pos + sizeof(Ext2DirEnt) <= bs) {
+        Ext2DirEnt *de = (void *)&root[pos];
+        if (de->reclen < sizeof(Ext2DirEnt) || pos + de->reclen > bs)
+            goto end;
+        if (de->inum)
+            ents[n++] = de;
+        pos += de->reclen;
     }
-    freememblock(tmp);
-    return count;
-error:
-    freememblock(tmp);
-    return -1;
+    packentries(leaf, bs, ents, n);
+    if (writedirblock(dir, 1, leaf)) goto end;
+    int version = ext2->sb.defhashversion <= DX_HASH_TEA
+            ? ext2->sb.defhashversion : DX_HASH_HALF_MD4;
+    DxEntry *entries = dxinitroot(root, bs, version, 0);
+    DxCountLimit *cl = (void *)entries;
+    cl->count = 1;
+    cl->block = 1;
+    if (writedirblock(dir, 0, root)) goto end;
+    rv = setindexed(dir, 1);
+end:
+    free(ents);
+    freememblock(root);
+    freememblock(leaf);
+    return rv;
 }
 
-static int ext2truncate(Vnode *vn) {
-    Ext2 *ext2 = vn->device;
-    Inode inode;
-    if (readinode(ext2, &inode, vn->vnum))
-        return -1;
-    setinodesize(&inode, 0);
-    memset(inode.blocks, 0, sizeof(inode.blocks));
-    inode.mtime = now();
-    if (writeinode(ext2, vn->vnum, &inode))
-        return -1;
-    return 0;
+static int isdots(char *name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
 }
 
-static int ext2write(Vnode *vn, int off, int count, void *src) {
-    Ext2 *ext2 = vn->device;
-    int blockoff = off % ext2->blocksz;
-    int blockrem = ext2->blocksz - blockoff;
-    count = blockrem < count ? blockrem : count;
+static int ext2find(Vnode *parent, Vnode *dst, char *name) {
+    Ext2 *ext2 = parent->device;
     Inode inode;
-    if (readinode(ext2, &inode, vn->vnum))
-        return -1;
-    // if (!(inode.mode & EXT2_S_IFREG)) {
-    //     printf("*** [%s] not a regular file\n", vn->name);
-    //     return -1;
-    // }
-    int relblock = off / ext2->blocksz;
-    int absblock = getinodeblock(ext2, &inode, vn->vnum, relblock, 1);
-    if (absblock < 0) {
-        printf("*** block #%i doesn't exist\n", relblock);
+    if (readinode(ext2, &inode, parent->vnum))
         return -1;
+    // . and .. stay in block 0 of an indexed directory, outside the leaves
+    if (dxindexed(ext2, &inode) && !isdots(name)) {
+        uint32_t inum = 0;
+        uint32_t leaf;
+        uint8_t ft;
+        int r = dxfind(parent, name, &inum, &ft, &leaf);
+        if (r > 0)
+            return entryvnode(ext2, dst, inum, ftformat(ext2, ft));
+        if (r == 0)
+            return -1;
     }
-    char *tmp = allocmemblock(ext2);
-    if (readblock(ext2, absblock, tmp)) {
-        freememblock(tmp);
-        return -1;
+    prefetchrange(ext2, &inode, parent->vnum, 0, inodesize(&inode));
+    DirEnt des[FIND_BATCH];
+    int64_t off = 0;
+    int n;
+    while ((n = listdir(parent, &off, des, FIND_BATCH)) > 0) {
+        for (int k = 0; k < n; k++)
+            if (strcmp(des[k].name, name) == 0)
+                return entryvnode(ext2, dst, des[k].vnum, des[k].type);
     }
-    memcpy(&tmp[blockoff], src, count);
-    if (writeblock(ext2, absblock, tmp)) {
-        freememblock(tmp);
+    return -1;
+}
+
+// marks a free inode of group gi used, 0 when it has none, -1 on error
+static int takeinode(Ext2 *ext2, int gi, int isdir) {
+    Group g;
+    if (readgroup(ext2, &g, gi))
         return -1;
-    }
-    freememblock(tmp);
-    uint64_t newsize = inodesize(&inode);
-    newsize = off + count > newsize ? off + count : newsize;
-    setinodesize(&inode, newsize);
-    inode.mtime = now();
-    if (writeinode(ext2, vn->vnum, &inode))
+    if (!g.freeinodes) return 0;
+    Bitmap *bm = getbitmap(ext2, ext2->inodemaps, gi, g.inodebitmap);
+    if (!bm)
         return -1;
-    return count;
+    int i = takebit(bm, ext2->sb.inodespergroup);
+    if (i < 0) return 0;
+    // set changes
+    ext2->sb.numfreeinodes--;
+    g.freeinodes--;
+    if (isdir)
+        g.numdirs++;
+    ext2->sbdirty = 1;
+    // the bitmap and descriptor stay resident until sync
+    if (writegroup(ext2, gi, &g))
+        return -1;
+    return gi * ext2->sb.inodespergroup + i + 1;
 }
 
-static int fillvnode(Ext2 *ext2, Vnode *dst, uint32_t inum);
-
-static int ext2readdir(Vnode *parent, DirEnt *dst, int index) {
-    if (!(parent->flags & VFS_DIR))
-        return -1;
-    struct {
-        Ext2DirEnt de;
-        char namebuf[MAX_NAME];
-    } s;
-    int i = 0;
-    int off = 0;
-    int r;
-    while ((r = ext2read(parent, &s.de, off, sizeof(Ext2DirEnt) + MAX_NAME))) {
-        if (s.de.inum && i == index) {
-            memcpy(dst->name, s.de.name, s.de.namelen);
-            dst->name[s.de.namelen] = 0;
-            dst->vnum = s.de.inum;
-            return 0;
+// picks a group for a new directory, spreading them orlov style: the
+// children of the root go to the emptiest group with fewest directories,
+// deeper ones to the first group from the parent's with room to grow
+static int dirgroup(Ext2 *ext2, int pgi, uint32_t parent) {
+    int n = ext2->numgroups;
+    uint32_t dirs = 0;
+    for (int gi = 0; gi < n; gi++) {
+        Group g;
+        if (readgroup(ext2, &g, gi)) return -1;
+        dirs += g.numdirs;
+    }
+    uint32_t avgfreei = ext2->sb.numfreeinodes / n;
+    uint32_t avgfreeb = ext2->sb.numfreeblocks / n;
+    uint32_t avgdirs = dirs / n;
+    if (parent == ROOT_INUM) {
+        int best = -1;
+        uint32_t bestdirs = UINT32_MAX;
+        for (int k = 0; k < n; k++) {
+            // start past the parent's group so ties don't pile up in one
+            int gi = (pgi + 1 + k) % n;
+            Group g;
+            if (readgroup(ext2, &g, gi)) return -1;
+            if (g.freeinodes < avgfreei || g.freeblocks < avgfreeb)
+                continue;
+            if (g.numdirs < bestdirs) {
+                best = gi;
+                bestdirs = g.numdirs;
+            }
+        }
+        if (best >= 0) return best;
+    } else {
+        uint32_t ipg = ext2->sb.inodespergroup;
+        uint32_t bpg = ext2->sb.blockspergroup;
+        uint32_t maxdirs = avgdirs + ipg / 16;
+        uint32_t minfreei = avgfreei > ipg / 4 ? avgfreei - ipg / 4 : 1;
+        uint32_t minfreeb = avgfreeb > bpg / 4 ? avgfreeb - bpg / 4 : 1;
+        for (int k = 0; k < n; k++) {
+            int gi = (pgi + k) % n;
+            Group g;
+            if (readgroup(ext2, &g, gi)) return -1;
+            if (g.numdirs < maxdirs && g.freeinodes >= minfreei && g.freeblocks >= minfreeb)
+                return gi;
         }
-        off += s.de.reclen;
-        if (s.de.inum)
-            i++;
+    }
+    // no group stands out, take the first with a free inode
+    for (int k = 0; k < n; k++) {
+        int gi = (pgi + k) % n;
+        Group g;
+        if (readgroup(ext2, &g, gi)) return -1;
+        if (g.freeinodes) return gi;
     }
     return -1;
 }
 
-static int ext2find(Vnode *parent, Vnode *dst, char *name) {
-    DirEnt de;
-    int i = 0;
-    while (ext2readdir(parent, &de, i) == 0) {
-        if (strcmp(de.name, name) == 0) {
-            Ext2 *ext2 = parent->device;
-            fillvnode(ext2, dst, de.vnum);
-            return 0;
-        }
-        i++;
+// picks a group for a new file: its parent's when that has inodes and
+// blocks free, then groups hashed off the parent's, then any with an inode
+static int filegroup(Ext2 *ext2, int pgi) {
+    int n = ext2->numgroups;
+    Group g;
+    if (readgroup(ext2, &g, pgi)) return -1;
+    if (g.freeinodes && g.freeblocks)
+        return pgi;
+    for (int step = 1, gi = pgi; step < n; step <<= 1) {
+        gi = (gi + step) % n;
+        if (readgroup(ext2, &g, gi)) return -1;
+        if (g.freeinodes && g.freeblocks)
+            return gi;
+    }
+    for (int k = 1; k <= n; k++) {
+        int gi = (pgi + k) % n;
+        if (readgroup(ext2, &g, gi)) return -1;
+        if (g.freeinodes) return gi;
     }
     return -1;
 }
 
-static uint32_t allocinode(Ext2 *ext2) {
-    uint8_t *bitmap = allocmemblock(ext2);
-    uint32_t inum = 0;
-    for (int gi = 0; gi < ext2->numgroups; gi++) {
-        Group g;
-        if (readgroup(ext2, &g, gi))
-            goto end;
-        if (!g.freeinodes) continue;
-        if (readblock(ext2, g.inodebitmap, bitmap))
-            goto end;
-        for (int i = 0; i < ext2->sb.inodespergroup; i++) {
-            if (testbit(bitmap, i)) continue;
-            // set changes
-            ext2->sb.numfreeinodes--;
-            g.freeinodes--;
-            setbit(bitmap, i);
-            // flush changes
-            if (writesb(ext2)) goto end;
-            if (writegroup(ext2, gi, &g)) goto end;
-            if (writeblock(ext2, g.inodebitmap, bitmap)) goto end;
-            // set found inum
-            inum = gi * ext2->sb.inodespergroup + i + 1;
-            goto end;
-        }
-    }
-end:
-    freememblock(bitmap);
+// allocates an inode for a child of parent, placed by dirgroup or
+// filegroup; 0 when there is none free, -1 on error
+static int allocinode(Ext2 *ext2, uint32_t parent, int mode) {
+    int isdir = (mode & VFS_MASK_FMT) == EXT2_S_IFDIR;
+    int pgi = (parent - 1) / ext2->sb.inodespergroup;
+    int gi = isdir ? dirgroup(ext2, pgi, parent) : filegroup(ext2, pgi);
+    if (gi < 0)
+        return -1;
+    int inum = takeinode(ext2, gi, isdir);
+    // the counts said there was room, the bitmap may still disagree
+    for (int k = 1; !inum && k < ext2->numgroups; k++)
+        inum = takeinode(ext2, (gi + k) % ext2->numgroups, isdir);
     return inum;
 }
 
-static int freeinode(Ext2 *ext2, uint32_t inum) {
-    uint8_t *bitmap = allocmemblock(ext2);
+static int freeinode(Ext2 *ext2, uint32_t inum, int mode) {
     int gi = (inum - 1) / ext2->sb.inodespergroup;
     Group g;
     if (readgroup(ext2, &g, gi)) goto error;
-    if (readblock(ext2, g.inodebitmap, bitmap)) goto error;
+    Bitmap *bm = getbitmap(ext2, ext2->inodemaps, gi, g.inodebitmap);
+    if (!bm) goto error;
     int idx = (inum - 1) % ext2->sb.inodespergroup;
-    if (!testbit(bitmap, idx)) goto unallocated;
+    if (!testbit(bm->words, idx)) goto unallocated;
     // set changes
-    clearbit(bitmap, idx);
+    putbit(bm, idx);
     g.freeinodes++;
+    if ((mode & VFS_MASK_FMT) == EXT2_S_IFDIR)
+        g.numdirs--;
     ext2->sb.numfreeinodes++;
-    // flush changes
-    if (writeblock(ext2, g.inodebitmap, bitmap)) goto error;
+    ext2->sbdirty = 1;
+    // the bitmap and descriptor stay resident until sync
     if (writegroup(ext2, gi, &g)) goto error;
-    if (writesb(ext2)) goto error;
-    // printf("successfully freed inode %u\n", inum);
-    freememblock(bitmap);
     return 0;
 unallocated:
     printf("*** inode %u already free\n", inum);
 error:
     printf("*** couldn't free inode %u\n", inum);
-    freememblock(bitmap);
     return -1;
 }
 
@@ -448,74 +2358,150 @@ static int inclinks(Ext2 *ext2, uint32_t inum) {
     if (readinode(ext2, &inode, inum))
         return -1;
     inode.numlinks++;
+    inode.ctime = now();
     if (writeinode(ext2, inum, &inode))
         return -1;
     return 0;
 }
 
-static int mkentry(Vnode *parent, char *name, uint32_t inum) {
+// puts an entry into the first gap of the directory that fits it and into
+// a new block otherwise, unless grow is 0 and it returns 1; entries never
+// cross block boundaries and the last one in a block runs to its end
+static int lineadd(Vnode *parent, char *name, uint32_t inum, uint8_t ft, int grow) {
+    Ext2 *ext2 = parent->device;
+    Inode inode;
+    if (readinode(ext2, &inode, parent->vnum))
+        return -1;
+    int namelen = strlen(name);
+    uint32_t bs = ext2->blocksz;
+    uint32_t nblocks = (inodesize(&inode) + bs - 1) / bs;
+    char *tmp = allocmemblock(ext2);
+    int rv = -1;
+    if (nblocks > 1)
+        prefetchrange(ext2, &inode, parent->vnum, 0, nblocks * bs);
+    for (uint32_t idx = 0; idx < nblocks; idx++) {
+        if (readdirblock(parent, idx, tmp))
+            goto end;
+        if (!blockadd(tmp, bs, name, namelen, inum, ft)) {
+            rv = writedirblock(parent, idx, tmp);
+            goto end;
+        }
+    }
+    if (!grow) {
+        rv = 1;
+        goto end;
+    }
+    memset(tmp, 0, bs);
+    Ext2DirEnt *de = (void *)tmp;
+    de->inum = inum;
+    de->reclen = bs;
+    de->namelen = namelen;
+    de->filetype = ft;
+    memcpy(de->name, name, namelen);
+    rv = writedirblock(parent, nblocks, tmp);
+end:
+    freememblock(tmp);
+    return rv;
+}
+
+// links inum, an inode of the given mode, into parent under name
+static int mkentry(Vnode *parent, char *name, uint32_t inum, int mode) {
     Ext2 *ext2 = parent->device;
     Inode inode;
     if (readinode(ext2, &inode, parent->vnum))
         return -1;
     if (!hasformat(inode.mode, EXT2_S_IFDIR))
         return -1;
-    int namelen = strlen(name);
-    int reclen = sizeof(Ext2DirEnt) + namelen;
-    struct {
-        Ext2DirEnt de;
-        char namebuf[MAX_NAME];
-    } s;
-    s.de.inum = inum;
-    s.de.reclen = reclen;
-    s.de.namelen = namelen;
-    s.de.filetype = 0;
-    memcpy(s.de.name, name, namelen);
-    int w = ext2write(parent, inodesize(&inode), reclen, &s.de);
-    if (w != reclen) {
-        printf("*** wrote %i of %i\n", w, reclen);
-        return -1;
-    }
-    if (inclinks(ext2, inum))
+    if (inode.flags & EXT4_INLINE_DATA_FL) {
+        printf("*** inline directories are read-only\n");
         return -1;
-    return 0;
+    }
+    uint8_t ft = fttype(ext2, mode);
+    int rv = 1;
+    if (dxindexed(ext2, &inode) && !isdots(name)) {
+        rv = dxadd(parent, name, inum, ft);
+    } else if ((ext2->sb.featuresopt & COMPAT_DIR_INDEX) && !isdots(name)
+            && inodesize(&inode) == ext2->blocksz) {
+        // index the directory once it outgrows its first block
+        rv = lineadd(parent, name, inum, ft, 0);
+        if (rv > 0 && !dxconvert(parent))
+            rv = dxadd(parent, name, inum, ft);
+    }
+    if (rv < 0)
+        return -1;
+    if (rv > 0) {
+        // the index can't take it, the directory goes on without one
+        if ((inode.flags & EXT2_INDEX_FL) && setindexed(parent, 0))
+            return -1;
+        if (lineadd(parent, name, inum, ft, 1))
+            return -1;
+    }
+    return inclinks(ext2, inum);
 }
 
 static int fillvnode(Ext2 *ext2, Vnode *dst, uint32_t inum);
+static int ext2release(Vnode *vn);
 
-static int ext2create(Vnode *parent, char *name, int isdir) {
+// makes a fresh inode of the given mode and links it into parent, 0 on error
+static uint32_t mknode(Vnode *parent, char *name, int mode) {
     if (!(parent->flags & VFS_DIR)) {
         printf("*** parent not a dir\n");
-        return -1;
+        return 0;
     }
     Ext2 *ext2 = parent->device;
-    uint32_t inum = allocinode(ext2);
-    if (!inum) return -1;
+    int rv = allocinode(ext2, parent->vnum, mode);
+    if (rv <= 0) return 0;
+    uint32_t inum = rv;
     Inode inode;
     if (readinode(ext2, &inode, inum)) {
-        freeinode(ext2, inum);
-        return -1;
+        freeinode(ext2, inum, mode);
+        return 0;
     }
     fillinode(&inode);
-    inode.mode = isdir ? EXT2_S_IFDIR : EXT2_S_IFREG;
+    inode.mode = mode;
     inode.numlinks = 0;
     if (writeinode(ext2, inum, &inode)) {
-        freeinode(ext2, inum);
-        return -1;
+        freeinode(ext2, inum, mode);
+        return 0;
     }
-    if (mkentry(parent, name, inum)) {
+    if (mkentry(parent, name, inum, mode)) {
         printf("*** couldn't make entry\n");
-        freeinode(ext2, inum);
-        return -1;
+        freeinode(ext2, inum, mode);
+        return 0;
     }
-    if (isdir) {
+    if (hasformat(mode, EXT2_S_IFDIR)) {
         Vnode vn;
         if (fillvnode(ext2, &vn, inum))
-            return -1;
-        mkentry(&vn, ".", inum);
-        mkentry(&vn, "..", parent->vnum);
+            return 0;
+        mkentry(&vn, ".", inum, EXT2_S_IFDIR);
+        mkentry(&vn, "..", parent->vnum, EXT2_S_IFDIR);
+        ext2release(&vn);
     }
-    return 0;
+    return inum;
+}
+
+static int ext2create(Vnode *parent, char *name, int isdir) {
+    return mknode(parent, name, isdir ? EXT2_S_IFDIR : EXT2_S_IFREG) ? 0 : -1;
+}
+
+// 1 when a directory holds nothing but . and .., 0 when it holds more
+static int dirempty(Ext2 *ext2, uint32_t inum) {
+    Vnode dir;
+    if (fillvnode(ext2, &dir, inum))
+        return -1;
+    DirEnt des[FIND_BATCH];
+    int64_t off = 0;
+    int n, empty = 1;
+    while (empty && (n = listdir(&dir, &off, des, FIND_BATCH)) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (strcmp(des[i].name, ".") && strcmp(des[i].name, "..")) {
+                empty = 0;
+                break;
+            }
+        }
+    }
+    ext2release(&dir);
+    return n < 0 ? -1 : empty;
 }
 
 static int ext2unlink(Vnode *parent, char *name) {
@@ -528,6 +2514,10 @@ static int ext2unlink(Vnode *parent, char *name) {
     Inode inode;
     if (readinode(ext2, &inode, parent->vnum))
         return -1;
+    if (inode.flags & EXT4_INLINE_DATA_FL) {
+        printf("*** inline directories are read-only\n");
+        return -1;
+    }
     int off = 0;
     int size = inodesize(&inode);
     char *tmp = allocmemblock(ext2);
@@ -535,40 +2525,66 @@ static int ext2unlink(Vnode *parent, char *name) {
     Ext2DirEnt *prev = 0;
     Ext2DirEnt *target = 0;
     int absblock = 0;
-    int boff = 0;
+    if (dxindexed(ext2, &inode)) {
+        uint32_t inum;
+        uint32_t leaf;
+        int r = dxfind(parent, name, &inum, 0, &leaf);
+        if (r == 0) goto missing;
+        // a damaged index leaves the linear scan to find it
+        if (r > 0) {
+            off = leaf * ext2->blocksz;
+            size = off + ext2->blocksz;
+        }
+    }
+    if (size - off > ext2->blocksz)
+        prefetchrange(ext2, &inode, parent->vnum, off, size);
     while (off < size) {
         int relblock = off / ext2->blocksz;
         absblock = getinodeblock(ext2, &inode, parent->vnum, relblock, 0);
         if (absblock < 0) goto end;
-        if (readblock(ext2, absblock, tmp)) goto end;
-        prev = 0;
-        target = 0;
-        boff = 0;
-        while (boff < ext2->blocksz) {
-            Ext2DirEnt *de = (void *)&tmp[boff];
-            if (de->namelen == namelen) {
-                if (strncmp(de->name, name, namelen) == 0) {
-                    target = de;
-                    goto found;
-                }
-            }
-            prev = de;
-            boff += de->reclen;
-        }
+        if (absblock && readblock(ext2, absblock, tmp)) goto end;
+        if (absblock && (target = blockfind(tmp, ext2->blocksz, name, namelen, &prev)))
+            goto found;
         off += ext2->blocksz;
     }
+missing:
+    printf("*** no entry [%s]\n", name);
+    goto end;
 found:;
     Inode tinode;
     if (readinode(ext2, &tinode, target->inum))
         goto end;
-    tinode.numlinks--;
+    int isdir = hasformat(tinode.mode, EXT2_S_IFDIR);
+    if (isdir) {
+        int empty = dirempty(ext2, target->inum);
+        if (empty < 0) goto end;
+        if (!empty) {
+            printf("*** directory not empty\n");
+            goto end;
+        }
+    }
+    // a directory goes with its one name, taking its . along
+    tinode.numlinks = isdir ? 0 : tinode.numlinks - 1;
+    tinode.ctime = now();
+    int dead = tinode.numlinks == 0;
+    if (dead) {
+        if (freeinodeblocks(ext2, &tinode, target->inum))
+            goto end;
+        setinodesize(&tinode, 0);
+        tinode.dtime = now();
+    }
     if (writeinode(ext2, target->inum, &tinode))
         goto end;
-    if (tinode.numlinks == 0) { 
-        freeinode(ext2, target->inum);
-    }
-    else if (tinode.numlinks == 1 && hasformat(tinode.mode, EXT2_S_IFDIR)) { 
-        freeinode(ext2, target->inum);
+    if (dead)
+        freeinode(ext2, target->inum, tinode.mode);
+    // the removed directory's .. no longer refers to the parent
+    if (isdir) {
+        if (readinode(ext2, &inode, parent->vnum))
+            goto end;
+        inode.numlinks--;
+        inode.ctime = now();
+        if (writeinode(ext2, parent->vnum, &inode))
+            goto end;
     }
     if (prev) {
         prev->reclen += target->reclen;
@@ -582,46 +2598,251 @@ found:;
         rv = 0;
     }
 end:
-    freememblock(ext2);
+    freememblock(tmp);
     return rv;
 }
 
-static int ext2symlink(Vnode *parent, char *name, char *value) {
-    if (ext2create(parent, name, 0))
+// checks that the records of a directory block chain up to its end
+static int blockvalid(char *buf, uint32_t bs) {
+    uint32_t pos = 0;
+    while (pos < bs) {
+        Ext2DirEnt *de = (void *)&buf[pos];
+        if (pos + sizeof(Ext2DirEnt) > bs || de->reclen < sizeof(Ext2DirEnt)
+                || de->reclen % 4 || pos + de->reclen > bs
+                || DIRENT_LEN(de->namelen) > de->reclen)
+            return 0;
+        pos += de->reclen;
+    }
+    return 1;
+}
+
+// lays an indexed directory of *nblocks blocks out afresh: its entries,
+// sorted by hash, fill leaves from block 1 on, the root in block 0 points
+// at them and, if they are too many for it, at one level of nodes after
+// them; *nblocks is set to the blocks now in use, 1 is returned if the
+// index can't be rebuilt and the directory was left alone
+static int dxrebuild(Vnode *dir, uint32_t *nblocks) {
+    Ext2 *ext2 = dir->device;
+    uint32_t bs = ext2->blocksz;
+    uint32_t old = *nblocks;
+    uint32_t max = old * (bs / DIRENT_LEN(1));
+    char *in = malloc((size_t)old * bs);
+    char *buf = allocmemblock(ext2);
+    DxSort *ents = malloc(max * sizeof(DxSort));
+    Ext2DirEnt **order = malloc(max * sizeof(Ext2DirEnt *));
+    DxEntry *leaves = malloc((max + 1) * sizeof(DxEntry));
+    DxEntry *nodes = malloc(bs);
+    int rv = -1;
+    if (!in || !ents || !order || !leaves || !nodes) goto end;
+    for (uint32_t idx = 0; idx < old; idx++)
+        if (readdirblock(dir, idx, &in[idx * bs])) goto end;
+    DxRootInfo *info = (void *)&in[DX_ROOT_INFO];
+    rv = 1;
+    if (info->reserved || info->infolen != sizeof(DxRootInfo)
+            || info->hashversion > DX_HASH_TEA)
+        goto end;
+    int version = info->hashversion;
+    if (ext2->sb.flags & SB_UNSIGNED_HASH)
+        version += DX_HASH_LEGACY_UNSIGNED;
+    // block 0 only shows . and .., index nodes show nothing at all
+    int n = 0;
+    for (uint32_t idx = 1; idx < old; idx++) {
+        char *b = &in[idx * bs];
+        for (uint32_t p = 0; p < bs; p += ((Ext2DirEnt *)&b[p])->reclen) {
+            Ext2DirEnt *de = (void *)&b[p];
+            if (de->inum)
+                ents[n++] = (DxSort){dxhash(de->name, de->namelen, version, ext2->sb.hashseed), de};
+        }
+    }
+    qsort(ents, n, sizeof(DxSort), cmpdxsort);
+    for (int i = 0; i < n; i++)
+        order[i] = ents[i].de;
+    // leaves are filled in hash order, for now block holds the index
+    // of each one's first entry
+    int nleaves = 0;
+    for (int start = 0; start < n || !nleaves; ) {
+        uint32_t hash = start < n ? ents[start].hash : 0;
+        // names hashing alike continue in the next leaf
+        if (start && hash == ents[start - 1].hash)
+            hash |= 1;
+        leaves[nleaves++] = (DxEntry){hash, start};
+        uint32_t size = 0;
+        while (start < n && size + DIRENT_LEN(order[start]->namelen) <= bs)
+            size += DIRENT_LEN(order[start++]->namelen);
+    }
+    uint32_t rootlimit = (bs - DX_ROOT_INFO - sizeof(DxRootInfo)) / sizeof(DxEntry);
+    uint32_t nodelimit = (bs - DX_NODE_ENTRIES) / sizeof(DxEntry);
+    uint32_t nnodes = nleaves <= rootlimit ? 0 : (nleaves + nodelimit - 1) / nodelimit;
+    if (nnodes > rootlimit)
+        goto end;
+    rv = -1;
+    for (int k = 0; k < nleaves; k++) {
+        int start = leaves[k].block;
+        int stop = k + 1 < nleaves ? (int)leaves[k + 1].block : n;
+        packentries(buf, bs, order + start, stop - start);
+        leaves[k].block = 1 + k;
+        if (writedirblock(dir, 1 + k, buf)) goto end;
+    }
+    for (uint32_t k = 0; k < nnodes; k++) {
+        uint32_t first = k * nodelimit;
+        uint32_t count = nleaves - first < nodelimit ? nleaves - first : nodelimit;
+        dxfillnode(buf, bs, leaves + first, count);
+        nodes[k] = (DxEntry){leaves[first].hash, 1 + nleaves + k};
+        if (writedirblock(dir, 1 + nleaves + k, buf)) goto end;
+    }
+    memcpy(buf, in, bs);
+    DxEntry *entries = dxinitroot(buf, bs, info->hashversion, nnodes ? 1 : 0);
+    int count = nnodes ? nnodes : nleaves;
+    memcpy(entries, nnodes ? nodes : leaves, count * sizeof(DxEntry));
+    DxCountLimit *cl = (void *)entries;
+    cl->limit = rootlimit;
+    cl->count = count;
+    if (writedirblock(dir, 0, buf)) goto end;
+    *nblocks = 1 + nleaves + nnodes;
+    rv = 0;
+end:
+    free(in);
+    free(ents);
+    free(order);
+    free(leaves);
+    free(nodes);
+    freememblock(buf);
+    return rv;
+}
+
+// rewrites the entries of a directory densely from its first block on and
+// releases the blocks that end up empty behind them
+static int ext2compact(Vnode *dir) {
+    Ext2 *ext2 = dir->device;
+    Inode inode;
+    if (readinode(ext2, &inode, dir->vnum))
         return -1;
-    Vnode vn;
-    Inode i;
-    if (ext2find(parent, &vn, name))
+    if (!hasformat(inode.mode, EXT2_S_IFDIR))
         return -1;
-    if (readinode(parent->device, &i, vn.vnum))
+    if (inode.flags & EXT4_INLINE_DATA_FL)
+        return 0;
+    if (inode.flags & EXT4_EXTENTS_FL) {
+        printf("*** extent mapped files are read-only\n");
         return -1;
-    i.mode = EXT2_S_IFLNK;
-    if (writeinode(parent->device, vn.vnum, &i))
+    }
+    uint32_t bs = ext2->blocksz;
+    uint32_t nblocks = (inodesize(&inode) + bs - 1) / bs;
+    char *in = allocmemblock(ext2);
+    char *out = allocmemblock(ext2);
+    int rv = -1;
+    prefetchrange(ext2, &inode, dir->vnum, 0, nblocks * bs);
+    // nothing is moved unless every block can be walked
+    for (uint32_t idx = 0; idx < nblocks; idx++) {
+        if (readdirblock(dir, idx, in))
+            goto end;
+        if (!blockvalid(in, bs)) {
+            printf("*** damaged directory block %u\n", idx);
+            goto end;
+        }
+    }
+    uint32_t outidx = nblocks;
+    if (dxindexed(ext2, &inode)) {
+        int r = dxrebuild(dir, &outidx);
+        if (r < 0)
+            goto end;
+        if (r == 0)
+            goto shrink;
+        // the index can't be rebuilt, the directory goes on without one
+        if (setindexed(dir, 0))
+            goto end;
+    }
+    // packing never needs more blocks than the entries came from, so out
+    // is written at or behind the block being read
+    outidx = 0;
+    uint32_t pos = 0;
+    Ext2DirEnt *last = 0;
+    memset(out, 0, bs);
+    for (uint32_t idx = 0; idx < nblocks; idx++) {
+        if (readdirblock(dir, idx, in))
+            goto end;
+        for (uint32_t p = 0; p < bs; p += ((Ext2DirEnt *)&in[p])->reclen) {
+            Ext2DirEnt *de = (void *)&in[p];
+            if (!de->inum) continue;
+            uint32_t need = DIRENT_LEN(de->namelen);
+            if (pos + need > bs) {
+                last->reclen += bs - pos;
+                if (writedirblock(dir, outidx++, out))
+                    goto end;
+                memset(out, 0, bs);
+                pos = 0;
+            }
+            last = (void *)&out[pos];
+            memcpy(last, de, sizeof(Ext2DirEnt) + de->namelen);
+            last->reclen = need;
+            pos += need;
+        }
+    }
+    if (last)
+        last->reclen += bs - pos;
+    else
+        ((Ext2DirEnt *)out)->reclen = bs;
+    if (writedirblock(dir, outidx++, out))
+        goto end;
+shrink:
+    rv = 0;
+    if (outidx >= nblocks)
+        goto end;
+    rv = -1;
+    if (readinode(ext2, &inode, dir->vnum))
+        goto end;
+    setinodesize(&inode, (uint64_t)outidx * bs);
+    if (freeblocksfrom(ext2, &inode, dir->vnum, outidx))
+        goto end;
+    inode.mtime = inode.ctime = now();
+    rv = writeinode(ext2, dir->vnum, &inode);
+end:
+    freememblock(in);
+    freememblock(out);
+    return rv;
+}
+
+// targets shorter than blocks[] are stored there, longer ones in a block
+static int ext2symlink(Vnode *parent, char *name, char *value) {
+    Ext2 *ext2 = parent->device;
+    uint32_t inum = mknode(parent, name, EXT2_S_IFLNK);
+    if (!inum)
         return -1;
     int len = strlen(value);
-    if (ext2write(&vn, 0, len, value) != len)
+    Inode i;
+    if (len < sizeof(i.blocks)) {
+        if (readinode(ext2, &i, inum))
+            return -1;
+        memset(i.blocks, 0, sizeof(i.blocks));
+        memcpy(i.blocks, value, len);
+        setinodesize(&i, len);
+        return writeinode(ext2, inum, &i);
+    }
+    Vnode vn;
+    if (fillvnode(ext2, &vn, inum))
         return -1;
-    return 0;
+    int rv = ext2write(&vn, 0, len, value) == len ? 0 : -1;
+    ext2release(&vn);
+    return rv;
 }
 
 static int ext2link(Vnode *old, Vnode *newdir, char *newname) {
-    return mkentry(newdir, newname, old->vnum);
+    return mkentry(newdir, newname, old->vnum, old->flags);
 }
 
-static int ext2stat(Vnode *vn, Stat *dst) {
+static int fillstat(Ext2 *ext2, uint32_t inum, Stat *dst) {
     Inode inode;
-    if (readinode(vn->device, &inode, vn->vnum))
+    if (readinode(ext2, &inode, inum))
         return -1;
     memset(dst, 0, sizeof(Stat));
-    dst->dev = (intptr_t)vn->device;
-    dst->inum = vn->vnum;
+    dst->dev = (intptr_t)ext2;
+    dst->inum = inum;
     dst->mode = inode.mode;
     dst->numlinks = inode.numlinks;
     dst->uid = inode.uid;
     dst->gid = inode.gid;
     dst->rdev = 0;
     dst->size = inodesize(&inode);
-    dst->blocksz = ((Ext2 *)vn->device)->blocksz;
+    dst->blocksz = ext2->blocksz;
     dst->blocks = inode.sectors;
     dst->atime = inode.atime;
     dst->mtime = inode.mtime;
@@ -629,34 +2850,153 @@ static int ext2stat(Vnode *vn, Stat *dst) {
     return 0;
 }
 
-static int fillvnode(Ext2 *ext2, Vnode *dst, uint32_t inum) {
-    Inode inode;
-    if (readinode(ext2, &inode, inum))
+static int ext2stat(Vnode *vn, Stat *dst) {
+    return fillstat(vn->device, vn->vnum, dst);
+}
+
+static int cmpplus(const void *a, const void *b) {
+    uint32_t x = ((PlusSlot *)a)->inum, y = ((PlusSlot *)b)->inum;
+    return x < y ? -1 : x > y;
+}
+
+// reads entries like ext2readdir and stats them a batch at a time, the
+// inodes in table order so each inode table block is fetched once
+static int ext2readdirplus(Vnode *parent, int64_t *off, DirEntPlus *dst, int n) {
+    Ext2 *ext2 = parent->device;
+    DirEnt des[PLUS_BATCH];
+    PlusSlot order[PLUS_BATCH];
+    uint32_t blocks[PLUS_BATCH];
+    int got = 0;
+    while (got < n) {
+        int want = n - got < PLUS_BATCH ? n - got : PLUS_BATCH;
+        int k = ext2readdir(parent, off, des, want);
+        if (k < 0) return got ? got : -1;
+        if (k == 0) break;
+        for (int i = 0; i < k; i++) {
+            dst[got + i].ent = des[i];
+            order[i] = (PlusSlot){des[i].vnum, got + i};
+        }
+        qsort(order, k, sizeof(PlusSlot), cmpplus);
+        int nb = 0;
+        for (int i = 0; i < k; i++) {
+            uint32_t block;
+            int boff;
+            if (!inodeloc(ext2, order[i].inum, &block, &boff) && (!nb || blocks[nb - 1] != block))
+                blocks[nb++] = block;
+        }
+        if (nb > 1 && !ext2->bdev->map)
+            bcacheprefetch(&ext2->bcache, blocks, nb);
+        for (int i = 0; i < k; i++)
+            if (fillstat(ext2, order[i].inum, &dst[order[i].slot].stat))
+                return got ? got : -1;
+        got += k;
+    }
+    return got;
+}
+
+static int ext2sync(Vnode *vn) {
+    Ext2 *ext2 = vn->device;
+    if (flushinodes(ext2))
         return -1;
+    // windows only live in memory, the bitmaps go out without them
+    for (Ient *e = ext2->ilru.next; e != &ext2->ilru; e = e->next)
+        prerelease(ext2, e);
+    if (flushbitmaps(ext2))
+        return -1;
+    if (flushgroups(ext2))
+        return -1;
+    if (bcacheflush(&ext2->bcache))
+        return -1;
+    // free counts go out last, after the bitmaps they describe
+    if (ext2->sbdirty && writesb(ext2))
+        return -1;
+    return vfssync(ext2->bdev);
+}
+
+static int ext2retain(Vnode *vn) {
+    Ient *e = iget(vn->device, vn->vnum);
+    if (!e) return -1;
+    e->refs++;
+    return 0;
+}
+
+static int ext2release(Vnode *vn) {
+    Ient *e = iget(vn->device, vn->vnum);
+    if (!e || !e->refs) return -1;
+    e->refs--;
+    return 0;
+}
+
+// sets up the ops of a vnode for inum, flags being at least its format bits
+static void initvnode(Ext2 *ext2, Vnode *dst, uint32_t inum, int flags) {
     memset(dst, 0, sizeof(Vnode));
     // sprintf(dst->name, "[%i]", inum);
     dst->device = ext2;
     dst->vnum = inum;
-    dst->flags = inode.mode;
+    dst->flags = flags;
     dst->read = ext2read;
-    dst->write = ext2write;
+    dst->readv = ext2readv;
     dst->find = ext2find;
     dst->readdir = ext2readdir;
-    dst->create = ext2create;
-    dst->truncate = ext2truncate;
-    dst->unlink = ext2unlink;
-    dst->symlink = ext2symlink;
-    dst->link = ext2link;
+    dst->readdirplus = ext2readdirplus;
     dst->stat = ext2stat;
+    // read-only mounts leave the changing ops unset, the vfs refuses them
+    if (!(ext2->flags & EXT2_RDONLY)) {
+        dst->write = ext2write;
+        dst->create = ext2create;
+        dst->truncate = ext2truncate;
+        dst->compact = ext2compact;
+        dst->unlink = ext2unlink;
+        dst->symlink = ext2symlink;
+        dst->link = ext2link;
+    }
+    dst->sync = ext2sync;
+}
+
+// the returned vnode holds a reference to the in-core inode
+static int fillvnode(Ext2 *ext2, Vnode *dst, uint32_t inum) {
+    Ient *e = iget(ext2, inum);
+    if (!e) return -1;
+    Inode inode;
+    memcpy(&inode, e->raw, sizeof(Inode));
+    initvnode(ext2, dst, inum, inode.mode);
+    dst->retain = ext2retain;
+    dst->release = ext2release;
+    e->refs++;
+    return 0;
+}
+
+// a vnode for a directory entry: when the entry gives the type the inode
+// isn't read, and the vnode pins nothing, its ops read the inode as needed
+static int entryvnode(Ext2 *ext2, Vnode *dst, uint32_t inum, int type) {
+    if (!type)
+        return fillvnode(ext2, dst, inum);
+    initvnode(ext2, dst, inum, type);
     return 0;
 }
 
-int mkext2(Vnode *dst, Vnode *bdev) {
+int mkext2(Vnode *dst, Vnode *bdev, Ext2Opts *opts) {
     Ext2 *ext2 = malloc(sizeof(Ext2));
     memset(ext2, 0, sizeof(Ext2));
     ext2->bdev = bdev;
+    ext2->flags = opts ? opts->flags : 0;
+    ext2->ilru.prev = &ext2->ilru;
+    ext2->ilru.next = &ext2->ilru;
     if (readsb(ext2))
         return -1;
+    int cacheblocks = opts && opts->cacheblocks ? opts->cacheblocks
+            : EXT2_CACHE_BLOCKS;
+    if (bcacheinit(&ext2->bcache, bdev, ext2->blocksz, cacheblocks))
+        return -1;
+    if (opts && (opts->flushbytes || opts->flushage)
+            && bcachestartflusher(&ext2->bcache, opts->flushbytes, opts->flushage))
+        return -1;
+    if (loadgroups(ext2))
+        return -1;
+    ext2->blockmaps = calloc(ext2->numgroups, sizeof(Bitmap));
+    ext2->inodemaps = calloc(ext2->numgroups, sizeof(Bitmap));
+    if (!ext2->blockmaps || !ext2->inodemaps)
+        return -1;
     if (fillvnode(ext2, dst, 2))
         return -1;
     strcpy(dst->name, "[root]");
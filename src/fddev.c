@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <ext2/vfs.h>
+#include <ext2/fddev.h>
+
+#define DIO_ALIGN 4096
+
+typedef struct {
+    int fd;
+    int flags;
+} FdDev;
+
+static int aligned(FdDev *fd, void *buf, off_t off, int count) {
+    if (!(fd->flags & FDDEV_DIRECT)) return 1;
+    return (uintptr_t)buf % DIO_ALIGN == 0
+            && off % DIO_ALIGN == 0 && count % DIO_ALIGN == 0;
+}
+
+// allocates an aligned bounce buffer covering [off, off + count)
+static char *bounce(off_t off, int count, off_t *start, int *len) {
+    *start = off - off % DIO_ALIGN;
+    off_t end = off + count;
+    end = (end + DIO_ALIGN - 1) / DIO_ALIGN * DIO_ALIGN;
+    *len = end - *start;
+    void *buf;
+    if (posix_memalign(&buf, DIO_ALIGN, *len))
+        return 0;
+    return buf;
+}
+
+static int readfull(int fd, void *dst, off_t off, int count) {
+    int done = 0;
+    while (done < count) {
+        int n = pread(fd, (char *)dst + done, count - done, off + done);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+static int writefull(int fd, void *src, off_t off, int count) {
+    int done = 0;
+    while (done < count) {
+        int n = pwrite(fd, (char *)src + done, count - done, off + done);
+        if (n <= 0) return done ? done : -1;
+        done += n;
+    }
+    return done;
+}
+
+static int fddevread(Vnode *vn, void *dst, int64_t off, int count) {
+    FdDev *fd = vn->device;
+    if (aligned(fd, dst, off, count))
+        return readfull(fd->fd, dst, off, count);
+    off_t start;
+    int len;
+    char *buf = bounce(off, count, &start, &len);
+    if (!buf) return -1;
+    int n = readfull(fd->fd, buf, start, len);
+    if (n >= 0) {
+        n -= off - start;
+        n = n < 0 ? 0 : n < count ? n : count;
+        memcpy(dst, buf + off - start, n);
+    }
+    free(buf);
+    return n;
+}
+
+static int fddevreadv(Vnode *vn, IoVec *iov, int n, int64_t off) {
+    FdDev *fd = vn->device;
+    int total = 0;
+    for (int i = 0; i < n; i++)
+        total += iov[i].len;
+    int direct = fd->flags & FDDEV_DIRECT;
+    if (!direct && n <= IOV_MAX) {
+        struct iovec v[n];
+        for (int i = 0; i < n; i++)
+            v[i] = (struct iovec){iov[i].base, iov[i].len};
+        int done = preadv(fd->fd, v, n, off);
+        if (done < 0 || done == total) return done;
+        // short, fill in the rest piece by piece
+    }
+    int done = 0;
+    for (int i = 0; i < n; i++) {
+        int r = fddevread(vn, iov[i].base, off + done, iov[i].len);
+        if (r < 0) return done ? done : -1;
+        done += r;
+        if (r < iov[i].len) break;
+    }
+    return done;
+}
+
+static int fddevwrite(Vnode *vn, int64_t off, int count, void *src) {
+    FdDev *fd = vn->device;
+    int n;
+    if (aligned(fd, src, off, count)) {
+        n = writefull(fd->fd, src, off, count);
+    }
+    else {
+        // read-modify-write the aligned blocks around the request
+        off_t start;
+        int len;
+        char *buf = bounce(off, count, &start, &len);
+        if (!buf) return -1;
+        int r = readfull(fd->fd, buf, start, len);
+        if (r < 0) {
+            free(buf);
+            return -1;
+        }
+        memset(buf + r, 0, len - r);
+        memcpy(buf + off - start, src, count);
+        n = writefull(fd->fd, buf, start, len);
+        if (n > 0)
+            n = n - (off - start) < count ? n - (off - start) : count;
+        free(buf);
+    }
+    if (n > 0 && (fd->flags & FDDEV_FSYNC_WRITE) && fsync(fd->fd))
+        return -1;
+    return n;
+}
+
+static int fddevsync(Vnode *vn) {
+    FdDev *fd = vn->device;
+    if (fd->flags & (FDDEV_FSYNC_NONE | FDDEV_FSYNC_WRITE))
+        return 0;
+    return fsync(fd->fd) ? -1 : 0;
+}
+
+int mkfddev(Vnode *dst, char *filename, int flags) {
+    int oflags = flags & FDDEV_RDONLY ? O_RDONLY : O_RDWR;
+    if (flags & FDDEV_DIRECT)
+        oflags |= O_DIRECT;
+    int f = open(filename, oflags);
+    if (f < 0) return -1;
+    FdDev *fd = malloc(sizeof(FdDev));
+    fd->fd = f;
+    fd->flags = flags;
+    memset(dst, 0, sizeof(Vnode));
+    dst->device = fd;
+    dst->read = fddevread;
+    dst->readv = fddevreadv;
+    if (!(flags & FDDEV_RDONLY))
+        dst->write = fddevwrite;
+    dst->sync = fddevsync;
+    return 0;
+}
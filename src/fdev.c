@@ -2,36 +2,52 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <ext2/vfs.h>
+#include <ext2/bcache.h>
 #include <ext2/ext2.h>
+#include <ext2/fdev.h>
 
-static int fdevread(Vnode *vn, void *dst, int off, int count) {
+static int fdevread(Vnode *vn, void *dst, int64_t off, int count) {
     FILE *fp = vn->device;
-    if (fseek(fp, off, SEEK_SET))
-        return -1;
-    clearerr(fp);
-    int n = fread(dst, 1, count, fp);
-    if (n == 0 && ferror(fp)) return -1;
+    // the seek and the read must not interleave with the flusher's
+    flockfile(fp);
+    int n = -1;
+    if (fseeko(fp, off, SEEK_SET) == 0) {
+        clearerr(fp);
+        n = fread(dst, 1, count, fp);
+        if (n == 0 && ferror(fp)) n = -1;
+    }
+    funlockfile(fp);
     return n;
 }
 
-static int fdevwrite(Vnode *vn, int off, int count, void *src) {
+static int fdevwrite(Vnode *vn, int64_t off, int count, void *src) {
     FILE *fp = vn->device;
-    if (fseek(fp, off, SEEK_SET))
-        return -1;
-    clearerr(fp);
-    int n = fwrite(src, 1, count, fp);
-    if (n == 0 && ferror(fp)) return -1;
+    flockfile(fp);
+    int n = -1;
+    if (fseeko(fp, off, SEEK_SET) == 0) {
+        clearerr(fp);
+        n = fwrite(src, 1, count, fp);
+        if (n == 0 && ferror(fp)) n = -1;
+    }
+    funlockfile(fp);
     return n;
 }
 
-int mkfdev(Vnode *dst, char *filename) {
-    FILE *f = fopen(filename, "r+");
+static int fdevsync(Vnode *vn) {
+    return fflush(vn->device) ? -1 : 0;
+}
+
+int mkfdev(Vnode *dst, char *filename, int flags) {
+    FILE *f = fopen(filename, flags & FDEV_RDONLY ? "r" : "r+");
     if (!f) return -1;
     memset(dst, 0, sizeof(Vnode));
     // strcpy(dst->name, filename);
     dst->device = f;
     dst->read = fdevread;
-    dst->write = fdevwrite;
+    if (!(flags & FDEV_RDONLY))
+        dst->write = fdevwrite;
+    dst->sync = fdevsync;
     return 0;
 }
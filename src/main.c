@@ -3,8 +3,14 @@
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include <ext2/vfs.h>
+#include <ext2/dcache.h>
 #include <ext2/fdev.h>
+#include <ext2/mmapdev.h>
+#include <ext2/fddev.h>
+#include <ext2/uringdev.h>
+#include <ext2/bcache.h>
 #include <ext2/ext2.h>
 
 typedef struct {
@@ -13,29 +19,73 @@ typedef struct {
 } Help;
 
 static const Help HELP[] = {
-    {"ls path", "list directory content"},
+    {"ls [-l] path", "list directory content, -l with attributes"},
     {"cat path", "print file content"},
     {"stat path", "print information about file or directory"},
     {"write path", "overwrite file with stdin"},
     {"create path", "create file"},
     {"mkdir path", "create directory"},
     {"unlink path", "delete file or directory"},
+    {"compact path", "pack directory entries and free unused blocks"},
     {"symlink target path", "create symlink 'path' that points to 'target'"},
     {"link oldpath newpath", "create hard link 'newpath' referencing inode of 'oldpath'"},
     {0},
 };
 
+static const Help OPTHELP[] = {
+    {"-o opt[,opt...]", "mount options: ro, rw, noatime,"},
+    {"", "relatime (default), strictatime"},
+    {"-c blocks", "block cache size (default 1024)"},
+    {"-d stdio|mmap|pio|uring", "image access backend (default stdio)"},
+    {"-D", "pio: use O_DIRECT"},
+    {"-s none|sync|write", "pio: when to fsync (default sync)"},
+    {"-f bytes", "flusher: write back once this much is dirty"},
+    {"-a ms", "flusher: write back blocks dirty this long"},
+    {0},
+};
+
 static void usage() {
-    printf("Usage:\n%4sext2 image cmd [operand...]\n", "");
+    printf("Usage:\n%4sext2 [option...] image cmd [operand...]\n", "");
+    printf("Options:\n");
+    for (const Help *h = OPTHELP; h->cmd; h++) {
+        printf("%4s%-26s%s\n",
+                "", h->cmd, h->text);
+    }
     printf("Commands:\n");
     for (const Help *h = HELP; h->cmd; h++) {
-        printf("%4s%-22s%s\n",
+        printf("%4s%-26s%s\n",
                 "", h->cmd, h->text);
     }
     exit(1);
 }
 
+static char typechar(int mode) {
+    switch (mode & VFS_MASK_FMT) {
+    case VFS_FILE: return '-';
+    case VFS_DIR: return 'd';
+    case VFS_LINK: return 'l';
+    }
+    return '?';
+}
+
+// format bits of an entry, looked up only when the filesystem doesn't say
+static int enttype(Vnode *dir, DirEnt *de) {
+    if (de->type)
+        return de->type;
+    Vnode vn;
+    if (vfsfind(dir, &vn, de->name))
+        return 0;
+    int type = vn.flags & VFS_MASK_FMT;
+    vfsrelease(&vn);
+    return type;
+}
+
 static void ls(Vnode *root, int argc, char **argv) {
+    int full = argc && strcmp(argv[0], "-l") == 0;
+    if (full) {
+        argc--;
+        argv++;
+    }
     if (!argc) {
         printf("*** ls requires path\n");
         usage();
@@ -46,17 +96,36 @@ static void ls(Vnode *root, int argc, char **argv) {
         printf("*** no such file [%s]\n", path);
         exit(1);
     }
-    if ((dir.flags & VFS_DIR) != VFS_DIR) {
+    Dir d;
+    if (vfsopendir(&dir, &d)) {
         printf("*** not a dir [%s]\n", path);
         exit(1);
     }
-    DirEnt de;
     int i = 0;
-    int rv;
-    while ((rv = vfsreaddir(&dir, &de, i)) == 0) {
-        printf("%2i: %3li %s\n", i, de.vnum, de.name);
-        i++;
+    int n;
+    if (full) {
+        DirEntPlus des[64];
+        while ((n = vfsreaddirplus(&d, des, 64)) > 0) {
+            for (int k = 0; k < n; k++, i++) {
+                Stat *st = &des[k].stat;
+                time_t mtime = st->mtime;
+                char when[32];
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&mtime));
+                printf("%2i: %3li %c%04o %3u %5u %5u %10u %s %s\n", i, des[k].ent.vnum,
+                        typechar(st->mode), st->mode & 07777, st->numlinks,
+                        st->uid, st->gid, st->size, when, des[k].ent.name);
+            }
+        }
+    }
+    else {
+        DirEnt des[64];
+        while ((n = vfsreaddirv(&d, des, 64)) > 0) {
+            for (int k = 0; k < n; k++, i++)
+                printf("%2i: %3li %c %s\n", i, des[k].vnum,
+                        typechar(enttype(&dir, &des[k])), des[k].name);
+        }
     }
+    vfsclosedir(&d);
 }
 
 static void cat(Vnode *root, int argc, char **argv) {
@@ -71,7 +140,7 @@ static void cat(Vnode *root, int argc, char **argv) {
         exit(1);
     }
     char buf[4096];
-    int off = 0;
+    int64_t off = 0;
     int n;
     while ((n = vfsread(&file, buf, off, sizeof(buf))) > 0) {
         fwrite(buf, 1, n, stdout);
@@ -106,8 +175,8 @@ static void write(Vnode *root, int argc, char **argv) {
         printf("*** couldn't truncate [%s]\n", path);
         exit(1);
     }
-    char buf[256];
-    int off = 0;
+    char buf[65536];
+    int64_t off = 0;
     int r;
     while ((r = fread(buf, 1, sizeof(buf), stdin))) {
         int w = vfswrite(&file, off, r, buf);
@@ -143,6 +212,26 @@ static void mkdir(Vnode *root, int argc, char **argv) {
     }
 }
 
+static void compact(Vnode *root, int argc, char **argv) {
+    if (!argc) {
+        printf("*** compact requires path\n");
+        usage();
+    }
+    char *path = argv[0];
+    Vnode dir;
+    if (vfsresolve(root, root, &dir, path)) {
+        printf("*** no such file [%s]\n", path);
+        exit(1);
+    }
+    Stat before, after;
+    if (vfsstat(&dir, &before) || vfscompact(&dir) || vfsstat(&dir, &after)) {
+        printf("*** couldn't compact [%s]\n", path);
+        exit(1);
+    }
+    printf("%u -> %u bytes\n", before.size, after.size);
+    vfsrelease(&dir);
+}
+
 static char *filetype(int type) {
     switch (type & VFS_MASK_FMT) {
     case VFS_FILE: return "regular file";
@@ -264,32 +353,182 @@ static Cmd CMDTAB[] = {
     {"write", write},
     {"unlink", unlink},
     {"mkdir", mkdir},
+    {"compact", compact},
     {"symlink", symlink},
     {"link", link},
     {"stat", stat},
     {0},
 };
 
+static Vnode *mounted;
+
+// flushes cached changes, also on the exit(1) paths of the commands, and
+// stops the flusher once nothing is left for it to write
+static void unmount() {
+    if (!mounted)
+        return;
+    dcachepurge(mounted->device);
+    if (vfssync(mounted))
+        printf("*** couldn't sync\n");
+    bcachefree(&((Ext2 *)mounted->device)->bcache);
+    mounted = 0;
+}
+
+typedef struct {
+    char *name;
+    int (*open)(Vnode *dst, char *filename);
+} Backend;
+
+static int fdflags;
+static int rdonly;
+
+static int mkstdio(Vnode *dst, char *filename) {
+    return mkfdev(dst, filename, rdonly ? FDEV_RDONLY : 0);
+}
+
+static int mkmmap(Vnode *dst, char *filename) {
+    return mkmmapdev(dst, filename, rdonly ? MMAPDEV_RDONLY : 0);
+}
+
+static int mkpio(Vnode *dst, char *filename) {
+    return mkfddev(dst, filename, fdflags | (rdonly ? FDDEV_RDONLY : 0));
+}
+
+static int mkuring(Vnode *dst, char *filename) {
+    return mkuringdev(dst, filename, 0, rdonly ? URINGDEV_RDONLY : 0);
+}
+
+static Backend BACKENDS[] = {
+    {"stdio", mkstdio},
+    {"mmap", mkmmap},
+    {"pio", mkpio},
+    {"uring", mkuring},
+    {0},
+};
+
+static Backend *backend = BACKENDS;
+
+typedef struct {
+    char *name;
+    int set;
+    int clear;
+} MountOpt;
+
+static MountOpt MOUNTOPTS[] = {
+    {"ro", EXT2_RDONLY, 0},
+    {"rw", 0, EXT2_RDONLY},
+    {"noatime", EXT2_NOATIME, EXT2_STRICTATIME},
+    {"relatime", 0, EXT2_NOATIME | EXT2_STRICTATIME},
+    {"strictatime", EXT2_STRICTATIME, EXT2_NOATIME},
+    {0},
+};
+
+// applies a comma separated list of mount options to flags
+static void parsemountopts(int *flags, char *list) {
+    for (char *name = strtok(list, ","); name; name = strtok(0, ",")) {
+        MountOpt *mo;
+        for (mo = MOUNTOPTS; mo->name; mo++)
+            if (strcmp(mo->name, name) == 0)
+                break;
+        if (!mo->name) {
+            printf("*** bad mount option [%s]\n", name);
+            usage();
+        }
+        *flags = (*flags & ~mo->clear) | mo->set;
+    }
+}
+
+static int parseopts(Ext2Opts *opts, int argc, char **argv) {
+    memset(opts, 0, sizeof(Ext2Opts));
+    int i = 1;
+    while (i < argc && argv[i][0] == '-') {
+        char *opt = argv[i++];
+        if (strcmp(opt, "-c") == 0 && i < argc) {
+            opts->cacheblocks = atoi(argv[i++]);
+            if (opts->cacheblocks <= 0) {
+                printf("*** bad cache size [%s]\n", argv[i - 1]);
+                usage();
+            }
+        }
+        else if (strcmp(opt, "-d") == 0 && i < argc) {
+            char *name = argv[i++];
+            for (backend = BACKENDS; backend->name; backend++)
+                if (strcmp(backend->name, name) == 0)
+                    break;
+            if (!backend->name) {
+                printf("*** no such backend [%s]\n", name);
+                usage();
+            }
+        }
+        else if (strcmp(opt, "-f") == 0 && i < argc) {
+            long long bytes = atoll(argv[i++]);
+            if (bytes <= 0) {
+                printf("*** bad dirty limit [%s]\n", argv[i - 1]);
+                usage();
+            }
+            opts->flushbytes = bytes;
+        }
+        else if (strcmp(opt, "-a") == 0 && i < argc) {
+            opts->flushage = atoi(argv[i++]);
+            if (opts->flushage <= 0) {
+                printf("*** bad age limit [%s]\n", argv[i - 1]);
+                usage();
+            }
+        }
+        else if (strcmp(opt, "-o") == 0 && i < argc) {
+            parsemountopts(&opts->flags, argv[i++]);
+        }
+        else if (strcmp(opt, "-D") == 0) {
+            fdflags |= FDDEV_DIRECT;
+        }
+        else if (strcmp(opt, "-s") == 0 && i < argc) {
+            char *policy = argv[i++];
+            fdflags &= ~(FDDEV_FSYNC_NONE | FDDEV_FSYNC_WRITE);
+            if (strcmp(policy, "none") == 0)
+                fdflags |= FDDEV_FSYNC_NONE;
+            else if (strcmp(policy, "write") == 0)
+                fdflags |= FDDEV_FSYNC_WRITE;
+            else if (strcmp(policy, "sync") != 0) {
+                printf("*** bad fsync policy [%s]\n", policy);
+                usage();
+            }
+        }
+        else {
+            printf("*** bad option [%s]\n", opt);
+            usage();
+        }
+    }
+    rdonly = opts->flags & EXT2_RDONLY;
+    return i;
+}
+
 int main(int argc, char **argv) {
-    if (argc < 3) {
+    Ext2Opts opts;
+    int argi = parseopts(&opts, argc, argv);
+    argc -= argi;
+    argv += argi;
+    if (argc < 2) {
         usage();
         exit(1);
     }
-    char *img = argv[1];
-    char *cmd = argv[2];
+    char *img = argv[0];
+    char *cmd = argv[1];
     Vnode bdev;
-    if (mkfdev(&bdev, img)) {
+    if (backend->open(&bdev, img)) {
         printf("*** couldn't open [%s]\n", img);
         exit(1);
     }
     Vnode ext2;
-    if (mkext2(&ext2, &bdev)) {
+    if (mkext2(&ext2, &bdev, &opts)) {
         printf("*** couldn't init ext2\n");
         exit(1);
     }
+    mounted = &ext2;
+    atexit(unmount);
     for (Cmd *cp = CMDTAB; cp->name; cp++) {
         if (strcmp(cp->name, cmd) == 0) {
-            cp->func(&ext2, argc - 3, argv + 3);
+            cp->func(&ext2, argc - 2, argv + 2);
+            unmount();
             return 0;
         }
     }
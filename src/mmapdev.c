@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ext2/vfs.h>
+#include <ext2/mmapdev.h>
+
+typedef struct {
+    int fd;
+    char *base;
+    size_t size;
+} MmapDev;
+
+// clamps a request to the mapped image, returns the usable count
+static int clamp(MmapDev *md, int64_t off, int count) {
+    if (off < 0 || count < 0) return -1;
+    if (off >= md->size) return 0;
+    return off + count <= md->size ? count : md->size - off;
+}
+
+static int mmapdevread(Vnode *vn, void *dst, int64_t off, int count) {
+    MmapDev *md = vn->device;
+    int n = clamp(md, off, count);
+    if (n > 0)
+        memcpy(dst, md->base + off, n);
+    return n;
+}
+
+static int mmapdevreadv(Vnode *vn, IoVec *iov, int n, int64_t off) {
+    int done = 0;
+    for (int i = 0; i < n; i++) {
+        int r = mmapdevread(vn, iov[i].base, off + done, iov[i].len);
+        if (r < 0) return done ? done : -1;
+        done += r;
+        if (r < iov[i].len) break;
+    }
+    return done;
+}
+
+static int mmapdevwrite(Vnode *vn, int64_t off, int count, void *src) {
+    MmapDev *md = vn->device;
+    int n = clamp(md, off, count);
+    if (n > 0)
+        memcpy(md->base + off, src, n);
+    return n;
+}
+
+static int mmapdevsync(Vnode *vn) {
+    MmapDev *md = vn->device;
+    return msync(md->base, md->size, MS_SYNC) ? -1 : 0;
+}
+
+static void *mmapdevmap(Vnode *vn, int64_t off, int count) {
+    MmapDev *md = vn->device;
+    if (clamp(md, off, count) != count)
+        return 0;
+    return md->base + off;
+}
+
+int mkmmapdev(Vnode *dst, char *filename, int flags) {
+    int rdonly = flags & MMAPDEV_RDONLY;
+    int fd = open(filename, rdonly ? O_RDONLY : O_RDWR);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    int prot = rdonly ? PROT_READ : PROT_READ | PROT_WRITE;
+    char *base = mmap(0, st.st_size, prot, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    MmapDev *md = malloc(sizeof(MmapDev));
+    md->fd = fd;
+    md->base = base;
+    md->size = st.st_size;
+    memset(dst, 0, sizeof(Vnode));
+    dst->device = md;
+    dst->read = mmapdevread;
+    dst->readv = mmapdevreadv;
+    if (!rdonly)
+        dst->write = mmapdevwrite;
+    dst->sync = mmapdevsync;
+    dst->map = mmapdevmap;
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <ext2/vfs.h>
+#include <ext2/uringdev.h>
+
+typedef struct {
+    int fd;
+    int ring;
+    unsigned entries;
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned *sqmask;
+    unsigned *sqarray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned *cqmask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;   // filled in, not yet handed to the kernel
+    unsigned inflight; // handed to the kernel, not yet reaped
+    pthread_mutex_t lock; // the rings are shared with the flusher thread
+} UringDev;
+
+static int enter(UringDev *ud, unsigned submit, unsigned min, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ud->ring, submit, min, flags, 0, 0);
+}
+
+static int reap(UringDev *ud) {
+    int n = 0;
+    unsigned head = *ud->cqhead;
+    while (head != __atomic_load_n(ud->cqtail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ud->cqes[head & *ud->cqmask];
+        IoReq *req = (IoReq *)(uintptr_t)cqe->user_data;
+        req->res = cqe->res < 0 ? -1 : cqe->res;
+        req->done = 1;
+        head++;
+        n++;
+    }
+    __atomic_store_n(ud->cqhead, head, __ATOMIC_RELEASE);
+    ud->inflight -= n;
+    return n;
+}
+
+// hands queued entries to the kernel, waiting for min completions
+static int flush(UringDev *ud, unsigned min) {
+    do {
+        int n = enter(ud, ud->queued, min, min ? IORING_ENTER_GETEVENTS : 0);
+        if (n < 0) return -1;
+        if (n == 0 && ud->queued && !min) return -1;
+        ud->queued -= n;
+        ud->inflight += n;
+    } while (ud->queued && !min);
+    return 0;
+}
+
+static int submit(UringDev *ud, IoReq *reqs, int n) {
+    for (int i = 0; i < n; i++) {
+        // keep completions from outrunning the completion ring
+        while (ud->queued + ud->inflight >= ud->entries) {
+            if (ud->queued ? flush(ud, 0) : flush(ud, 1))
+                return i ? i : -1;
+            reap(ud);
+        }
+        unsigned tail = *ud->sqtail;
+        unsigned idx = tail & *ud->sqmask;
+        struct io_uring_sqe *sqe = &ud->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = reqs[i].op == VFS_IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->fd = ud->fd;
+        sqe->addr = (uintptr_t)reqs[i].buf;
+        sqe->len = reqs[i].count;
+        sqe->off = reqs[i].off;
+        sqe->user_data = (uintptr_t)&reqs[i];
+        reqs[i].done = 0;
+        ud->sqarray[idx] = idx;
+        __atomic_store_n(ud->sqtail, tail + 1, __ATOMIC_RELEASE);
+        ud->queued++;
+    }
+    if (flush(ud, 0))
+        return -1;
+    return n;
+}
+
+static int uringdevsubmit(Vnode *vn, IoReq *reqs, int n) {
+    UringDev *ud = vn->device;
+    pthread_mutex_lock(&ud->lock);
+    n = submit(ud, reqs, n);
+    pthread_mutex_unlock(&ud->lock);
+    return n;
+}
+
+static int complete(UringDev *ud, int min) {
+    int n = reap(ud);
+    while (n < min && (ud->inflight || ud->queued)) {
+        if (flush(ud, 1))
+            return n ? n : -1;
+        n += reap(ud);
+    }
+    return n;
+}
+
+// another thread may reap our completions, so this returns without
+// waiting once nothing is left in flight
+static int uringdevcomplete(Vnode *vn, int min) {
+    UringDev *ud = vn->device;
+    pthread_mutex_lock(&ud->lock);
+    int n = complete(ud, min);
+    pthread_mutex_unlock(&ud->lock);
+    return n;
+}
+
+static int rw(Vnode *vn, int op, void *buf, int64_t off, int count) {
+    IoReq req = {op, buf, off, count};
+    if (uringdevsubmit(vn, &req, 1) != 1)
+        return -1;
+    while (!req.done)
+        if (uringdevcomplete(vn, 1) < 0)
+            return -1;
+    return req.res;
+}
+
+static int uringdevread(Vnode *vn, void *dst, int64_t off, int count) {
+    return rw(vn, VFS_IO_READ, dst, off, count);
+}
+
+// one read per buffer, all in a single batch
+static int uringdevreadv(Vnode *vn, IoVec *iov, int n, int64_t off) {
+    IoReq *reqs = malloc(n * sizeof(IoReq));
+    if (!reqs) return -1;
+    int64_t pos = off;
+    for (int i = 0; i < n; i++) {
+        reqs[i] = (IoReq){VFS_IO_READ, iov[i].base, pos, iov[i].len};
+        pos += iov[i].len;
+    }
+    vfsbatch(vn, reqs, n);
+    int done = 0;
+    for (int i = 0; i < n; i++) {
+        if (reqs[i].res < 0) {
+            done = done ? done : -1;
+            break;
+        }
+        done += reqs[i].res;
+        if (reqs[i].res < iov[i].len) break;
+    }
+    free(reqs);
+    return done;
+}
+
+static int uringdevwrite(Vnode *vn, int64_t off, int count, void *src) {
+    return rw(vn, VFS_IO_WRITE, src, off, count);
+}
+
+static int uringdevsync(Vnode *vn) {
+    UringDev *ud = vn->device;
+    return fsync(ud->fd) ? -1 : 0;
+}
+
+static void *mapring(UringDev *ud, size_t size, off_t off) {
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ud->ring, off);
+    return p == MAP_FAILED ? 0 : p;
+}
+
+int mkuringdev(Vnode *dst, char *filename, int depth, int flags) {
+    UringDev *ud = malloc(sizeof(UringDev));
+    memset(ud, 0, sizeof(UringDev));
+    ud->fd = open(filename, flags & URINGDEV_RDONLY ? O_RDONLY : O_RDWR);
+    if (ud->fd < 0) goto error;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ud->ring = syscall(__NR_io_uring_setup, depth ? depth : URINGDEV_DEPTH, &p);
+    if (ud->ring < 0) goto error;
+    ud->entries = p.sq_entries;
+    pthread_mutex_init(&ud->lock, 0);
+    size_t sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sqsz = cqsz = sqsz > cqsz ? sqsz : cqsz;
+    char *sq = mapring(ud, sqsz, IORING_OFF_SQ_RING);
+    if (!sq) goto error;
+    char *cq = p.features & IORING_FEAT_SINGLE_MMAP ? sq
+            : mapring(ud, cqsz, IORING_OFF_CQ_RING);
+    if (!cq) goto error;
+    ud->sqes = mapring(ud, p.sq_entries * sizeof(struct io_uring_sqe),
+            IORING_OFF_SQES);
+    if (!ud->sqes) goto error;
+    ud->sqhead = (unsigned *)(sq + p.sq_off.head);
+    ud->sqtail = (unsigned *)(sq + p.sq_off.tail);
+    ud->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ud->sqarray = (unsigned *)(sq + p.sq_off.array);
+    ud->cqhead = (unsigned *)(cq + p.cq_off.head);
+    ud->cqtail = (unsigned *)(cq + p.cq_off.tail);
+    ud->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ud->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    memset(dst, 0, sizeof(Vnode));
+    dst->device = ud;
+    dst->read = uringdevread;
+    dst->readv = uringdevreadv;
+    if (!(flags & URINGDEV_RDONLY))
+        dst->write = uringdevwrite;
+    dst->sync = uringdevsync;
+    dst->submit = uringdevsubmit;
+    dst->complete = uringdevcomplete;
+    return 0;
+error:
+    // rings are left mapped, the process is about to give up anyway
+    if (ud->ring > 0) close(ud->ring);
+    if (ud->fd >= 0) close(ud->fd);
+    free(ud);
+    return -1;
+}
@@ -2,13 +2,30 @@
 #include <string.h>
 #include <stdio.h>
 #include <ext2/vfs.h>
+#include <ext2/dcache.h>
 
-int vfsread(Vnode *vn, void *dst, int off, int count) {
+#define MAX_LINKS 8
+
+int vfsread(Vnode *vn, void *dst, int64_t off, int count) {
     if (!vn->read) return -1;
     return vn->read(vn, dst, off, count);
 }
 
-int vfswrite(Vnode *vn, int off, int count, void *src) {
+// reads consecutive bytes starting at off into the buffers in turn
+int vfsreadv(Vnode *vn, IoVec *iov, int n, int64_t off) {
+    if (vn->readv)
+        return vn->readv(vn, iov, n, off);
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        int r = vfsread(vn, iov[i].base, off + total, iov[i].len);
+        if (r < 0) return total ? total : -1;
+        total += r;
+        if (r < iov[i].len) break;
+    }
+    return total;
+}
+
+int vfswrite(Vnode *vn, int64_t off, int count, void *src) {
     if (!vn->write) return -1;
     return vn->write(vn, off, count, src);
 }
@@ -28,78 +45,145 @@ int vfsfind(Vnode *parent, Vnode *dst, char *name) {
     return parent->find(parent, dst, name);
 }
 
-int vfsresolve(Vnode *root, Vnode *parent, Vnode *dst, char *path) {
+static int resolve(Vnode *root, Vnode *parent, Vnode *dst, char *path, int depth) {
     char name[MAX_NAME];
     Vnode tmp = path[0] == '/' ? *root : *parent;
-    *dst = tmp;
+    vfsretain(&tmp);
     while ((path = nextname(name, path))) {
-        if (vfsfind(&tmp, dst, name))
-            return -1;
+        if (dcachefind(&tmp, dst, name))
+            goto fail;
         if ((dst->flags & VFS_LINK) == VFS_LINK) {
-            char buf[1024];
-            int len = vfsread(dst, buf, 0, sizeof(buf));
-            if (len < 0) return -1;
-            buf[len] = 0;
-            return vfsresolve(root, &tmp, dst, buf);
+            char target[MAX_PATH];
+            int len = -1;
+            if (depth < MAX_LINKS)
+                len = dcachelink(&tmp, name, dst, target, sizeof(target));
+            vfsrelease(dst);
+            if (len < 0 || resolve(root, &tmp, dst, target, depth + 1))
+                goto fail;
         }
+        vfsrelease(&tmp);
         tmp = *dst;
     }
+    *dst = tmp;
     return 0;
+fail:
+    vfsrelease(&tmp);
+    return -1;
+}
+
+// dst holds its own reference on success, release it when done
+int vfsresolve(Vnode *root, Vnode *parent, Vnode *dst, char *path) {
+    return resolve(root, parent, dst, path, 0);
 }
 
-int vfsreaddir(Vnode *parent, DirEnt *dst, int index) {
-    if (!parent->readdir) return -1;
-    return parent->readdir(parent, dst, index);
+// dst holds its own reference on the directory until vfsclosedir
+int vfsopendir(Vnode *vn, Dir *dst) {
+    if ((vn->flags & VFS_DIR) != VFS_DIR || !vn->readdir)
+        return -1;
+    dst->dir = *vn;
+    dst->off = 0;
+    return vfsretain(&dst->dir);
+}
+
+// reads the next entry, -1 at the end of the directory
+int vfsreaddir(Dir *dir, DirEnt *dst) {
+    return vfsreaddirv(dir, dst, 1) == 1 ? 0 : -1;
+}
+
+// reads up to n entries, returns how many, 0 at the end of the directory
+int vfsreaddirv(Dir *dir, DirEnt *dst, int n) {
+    if (!dir->dir.readdir) return -1;
+    return dir->dir.readdir(&dir->dir, &dir->off, dst, n);
+}
+
+// reads up to n entries with their attributes, returns how many; a
+// filesystem without the op gets each entry looked up and stat'ed
+int vfsreaddirplus(Dir *dir, DirEntPlus *dst, int n) {
+    if (dir->dir.readdirplus)
+        return dir->dir.readdirplus(&dir->dir, &dir->off, dst, n);
+    int got = 0;
+    while (got < n && vfsreaddirv(dir, &dst[got].ent, 1) == 1) {
+        Vnode vn;
+        memset(&dst[got].stat, 0, sizeof(Stat));
+        if (!vfsfind(&dir->dir, &vn, dst[got].ent.name)) {
+            vfsstat(&vn, &dst[got].stat);
+            vfsrelease(&vn);
+        }
+        got++;
+    }
+    return got;
+}
+
+int vfsclosedir(Dir *dir) {
+    return vfsrelease(&dir->dir);
 }
 
 int vfscreate(Vnode *parent, char *path, int isdir) {
     char name[MAX_NAME];
     Vnode prev = *parent;
     Vnode tmp;
+    int rv = -1;
+    vfsretain(&prev);
     while ((path = nextname(name, path))) {
         int dir = isdir || path[0] != 0;
-        if (vfsfind(&prev, &tmp, name)) {
-            if (!prev.create) return -1;
-            if (prev.create(&prev, name, dir)) {
+        if (dcachefind(&prev, &tmp, name)) {
+            if (!prev.create) goto end;
+            int err = prev.create(&prev, name, dir);
+            dcacheforget(&prev, name);
+            if (err) {
                 printf("*** couldn't create [%s]\n", name);
-                return -1;
+                goto end;
             }
-            if (vfsfind(&prev, &tmp, name)) {
+            if (dcachefind(&prev, &tmp, name)) {
                 printf("*** couldn't find created [%s]\n", name);
-                return -1;
+                goto end;
             }
         }
+        vfsrelease(&prev);
         prev = tmp;
     }
-    return 0;
+    rv = 0;
+end:
+    vfsrelease(&prev);
+    return rv;
 }
 
 int vfssymlink(Vnode *parent, char *path, char *value) {
     char name[MAX_NAME];
     Vnode prev = *parent;
     Vnode tmp;
+    int rv = -1;
+    vfsretain(&prev);
     while ((path = nextname(name, path))) {
         int isdir = path[0] != 0;
-        if (vfsfind(&prev, &tmp, name)) {
+        if (dcachefind(&prev, &tmp, name)) {
             if (isdir) {
-                if (!prev.create) return -1;
-                if (prev.create(&prev, name, isdir)) {
+                if (!prev.create) goto end;
+                int err = prev.create(&prev, name, isdir);
+                dcacheforget(&prev, name);
+                if (err) {
                     printf("*** couldn't create [%s]\n", name);
-                    return -1;
+                    goto end;
                 }
             }
             else {
-                if (!prev.symlink) return -1;
-                return prev.symlink(&prev, name, value);
+                if (!prev.symlink) goto end;
+                rv = prev.symlink(&prev, name, value);
+                dcacheforget(&prev, name);
+                goto end;
             }
-            if (vfsfind(&prev, &tmp, name)) {
+            if (dcachefind(&prev, &tmp, name)) {
                 printf("*** couldn't find created [%s]\n", name);
-                return -1;
+                goto end;
             }
         }
+        vfsrelease(&prev);
         prev = tmp;
     }
-    return 0;
+    rv = 0;
+end:
+    vfsrelease(&prev);
+    return rv;
 }
 
 int vfstruncate(Vnode *vn) {
@@ -107,37 +191,116 @@ int vfstruncate(Vnode *vn) {
     return vn->truncate(vn);
 }
 
+// packs a directory's entries and gives back the blocks it no longer needs
+int vfscompact(Vnode *dir) {
+    if ((dir->flags & VFS_DIR) != VFS_DIR || !dir->compact)
+        return -1;
+    return dir->compact(dir);
+}
+
 int vfsunlink(Vnode *parent, char *path) {
     char name[MAX_NAME];
     name[0] = 0;
     Vnode prev = *parent;
     Vnode tmp;
+    int isdir = 0;
+    int rv = -1;
+    vfsretain(&prev);
     while ((path = nextname(name, path))) {
-        if (vfsfind(&prev, &tmp, name)) {
+        if (dcachefind(&prev, &tmp, name)) {
             printf("*** couldn't find [%s]\n", name);
             goto end;
         }
-        if (path[0] == 0)
+        if (path[0] == 0) {
+            isdir = (tmp.flags & VFS_DIR) == VFS_DIR;
+            vfsrelease(&tmp);
             goto found;
+        }
+        vfsrelease(&prev);
         prev = tmp;
     }
 found:
     if (name[0]) {
-        if (!prev.unlink) return -1;
-        return prev.unlink(&prev, name);
+        if (!prev.unlink) goto end;
+        rv = prev.unlink(&prev, name);
+        // names below a removed directory go stale with it
+        if (isdir)
+            dcachepurge(prev.device);
+        else
+            dcacheforget(&prev, name);
+        goto end;
     }
     printf("*** can't unlink root\n");
-    return -1;
 end:
-    return -1;
+    vfsrelease(&prev);
+    return rv;
 }
 
 int vfslink(Vnode *old, Vnode *newdir, char *newname) {
     if (!old->link) return -1;
-    return old->link(old, newdir, newname);
+    int rv = old->link(old, newdir, newname);
+    dcacheforget(newdir, newname);
+    return rv;
 }
 
 int vfsstat(Vnode *vn, Stat *dst) {
     if (!vn->stat) return -1;
     return vn->stat(vn, dst);
 }
+
+int vfssync(Vnode *vn) {
+    if (!vn->sync) return 0;
+    return vn->sync(vn);
+}
+
+int vfsretain(Vnode *vn) {
+    if (!vn->retain) return 0;
+    return vn->retain(vn);
+}
+
+int vfsrelease(Vnode *vn) {
+    if (!vn->release) return 0;
+    return vn->release(vn);
+}
+
+// queues a batch of requests, devices without a queue run them right away
+int vfssubmit(Vnode *vn, IoReq *reqs, int n) {
+    if (vn->submit)
+        return vn->submit(vn, reqs, n);
+    for (int i = 0; i < n; i++) {
+        IoReq *r = &reqs[i];
+        if (r->op == VFS_IO_READ)
+            r->res = vfsread(vn, r->buf, r->off, r->count);
+        else
+            r->res = vfswrite(vn, r->off, r->count, r->buf);
+        r->done = 1;
+    }
+    return n;
+}
+
+// reaps at least min completions, returns how many were reaped
+int vfscomplete(Vnode *vn, int min) {
+    if (!vn->complete) return 0;
+    return vn->complete(vn, min);
+}
+
+// runs a whole batch, returns the number of requests that came up short
+int vfsbatch(Vnode *vn, IoReq *reqs, int n) {
+    int sent = vfssubmit(vn, reqs, n);
+    if (sent < 0) return n;
+    for (int i = 0; i < sent; i++)
+        while (!reqs[i].done)
+            if (vfscomplete(vn, 1) < 0)
+                return n;
+    int failed = n - sent;
+    for (int i = 0; i < sent; i++)
+        if (reqs[i].res != reqs[i].count)
+            failed++;
+    return failed;
+}
+
+// direct pointer to device content, 0 if the device can't provide one
+void *vfsmap(Vnode *vn, int64_t off, int count) {
+    if (!vn->map) return 0;
+    return vn->map(vn, off, count);
+}